@@ -0,0 +1,61 @@
+#include <linux/mod_devicetable.h>
+#include <linux/module.h>
+#include <linux/of.h>
+
+#include "hipi-ups.h"
+
+/* HiPi / PiShop UPS HAT. The UPS toggles its heartbeat every 500ms; allow 2s
+ * just to be safe.
+ */
+const struct hipi_ups_board hipi_ups_board_hipi = {
+    .name = "hipi",
+    .status_protocol = HIPI_UPS_STATUS_LEVEL,
+    .shutdown_delay_ms = 60000,
+    .heartbeat_timeout_ms = 2000,
+    .heartbeat_recover_ms = 2000,
+    .restore_stable_ms = 5000,
+};
+
+/* Generic HAT with a power fault line and, optionally, a status level and a
+ * heartbeat line wired like the HiPi's.
+ */
+static const struct hipi_ups_board hipi_ups_board_generic = {
+    .name = "gpio-ups",
+    .optional_lines = HIPI_UPS_STATUS_OPTIONAL | HIPI_UPS_ONLINE_OPTIONAL,
+    .status_protocol = HIPI_UPS_STATUS_LEVEL,
+    .shutdown_delay_ms = 60000,
+    .heartbeat_timeout_ms = 2000,
+    .heartbeat_recover_ms = 2000,
+    .restore_stable_ms = 5000,
+};
+
+/* As above, for HATs that want a heartbeat from the Pi on the status line and
+ * cut power once it stops.
+ */
+static const struct hipi_ups_board hipi_ups_board_generic_heartbeat = {
+    .name = "gpio-ups-heartbeat",
+    .optional_lines = HIPI_UPS_ONLINE_OPTIONAL,
+    .status_protocol = HIPI_UPS_STATUS_HEARTBEAT,
+    .status_period_ms = 500,
+    .shutdown_delay_ms = 60000,
+    .heartbeat_timeout_ms = 2000,
+    .heartbeat_recover_ms = 2000,
+    .restore_stable_ms = 5000,
+};
+
+const struct of_device_id hipi_ups_of_match[] = {
+    { .compatible = "custom,hipi-ups", .data = &hipi_ups_board_hipi },
+    { .compatible = "custom,gpio-ups", .data = &hipi_ups_board_generic },
+    { .compatible = "custom,gpio-ups-heartbeat", .data = &hipi_ups_board_generic_heartbeat },
+    { }
+};
+MODULE_DEVICE_TABLE(of, hipi_ups_of_match);
+
+/* Instances without DT, e.g. created through configfs, match by name */
+const struct platform_device_id hipi_ups_id_table[] = {
+    { "hipi_ups", (kernel_ulong_t)&hipi_ups_board_hipi },
+    { "gpio_ups", (kernel_ulong_t)&hipi_ups_board_generic },
+    { "gpio_ups_heartbeat", (kernel_ulong_t)&hipi_ups_board_generic_heartbeat },
+    { }
+};
+MODULE_DEVICE_TABLE(platform, hipi_ups_id_table);
@@ -0,0 +1,204 @@
+#include <linux/bpf.h>
+#include <linux/bpf_verifier.h>
+#include <linux/btf.h>
+#include <linux/module.h>
+#include <linux/rcupdate.h>
+#include <linux/stddef.h>
+#include <linux/timekeeping.h>
+
+#include "hipi-ups.h"
+
+/* Shutdown policy as a BPF struct_ops. Sites with their own rules (time of
+ * day, workload, outage history) attach a struct hipi_ups_ops instead of
+ * patching the driver:
+ *
+ *   bpftool struct_ops register hipi_ups_policy.bpf.o
+ *
+ * Every callback gets a read-only context and is optional; without a policy,
+ * or for callbacks it leaves NULL, the driver does what it always did. A
+ * battery-low line shuts down immediately whatever the policy says, and no
+ * policy keeps the host on battery past policy_max_extension_ms beyond the
+ * shutdown delay.
+ */
+
+/* What a policy gets to look at */
+struct hipi_ups_policy_ctx {
+    u32 id;              /* Instance index */
+    u32 power_state;     /* enum hipi_ups_power_state */
+    u32 heartbeat_state; /* enum hipi_ups_heartbeat_state */
+    u32 battery_low;
+    u32 charging;
+    s32 default_ms;      /* What the driver would do without a policy, see below */
+    u64 on_battery_ms;   /* Length of the current outage, 0 on mains */
+    u64 outages;         /* Outages since probe */
+    u64 shutdowns_cancelled;
+    s64 realtime_s;      /* Unix time, for time-of-day rules */
+};
+
+struct hipi_ups_ops {
+    /* Power just failed: return ms until shutdown (default_ms is the
+     * shutdown delay), or negative to hold off the countdown. Either way the
+     * shutdown comes no later than policy_max_extension_ms past the delay.
+     */
+    s32 (*on_battery)(const struct hipi_ups_policy_ctx *ctx);
+    /* Heartbeat went missing: while on battery, return ms to bring the
+     * countdown forward to; negative (the default) leaves it alone.
+     */
+    s32 (*heartbeat_lost)(const struct hipi_ups_policy_ctx *ctx);
+    /* Countdown ran out: return 0 (the default) to go on with the shutdown
+     * decision, or ms to extend the countdown by.
+     */
+    s32 (*countdown_expired)(const struct hipi_ups_policy_ctx *ctx);
+    /* Mains was back long enough to end the outage */
+    void (*restored)(const struct hipi_ups_policy_ctx *ctx);
+    char name[16];
+};
+
+static struct hipi_ups_ops __rcu *hipi_ups_policy;
+
+static void hipi_ups_policy_ctx_fill(struct gpio_data *data, struct hipi_ups_policy_ctx *ctx, s32 def)
+{
+    struct hipi_ups_snapshot snap;
+
+    hipi_ups_snapshot(data, &snap);
+    ctx->id = data->id;
+    ctx->power_state = snap.power_state;
+    ctx->heartbeat_state = snap.heartbeat_state;
+    ctx->battery_low = snap.battery_low;
+    ctx->charging = snap.charging;
+    ctx->default_ms = def;
+    ctx->on_battery_ms = snap.power_state != HIPI_UPS_POWER_MAINS ? snap.on_battery_ms - snap.stats.on_battery_ms : 0;
+    ctx->outages = snap.stats.outages;
+    ctx->shutdowns_cancelled = snap.stats.shutdowns_cancelled;
+    ctx->realtime_s = ktime_get_real_seconds();
+}
+
+/* Run one callback of the attached policy, or return def without one */
+#define HIPI_UPS_POLICY_CALL(data, op, def)                             \
+    ({                                                                  \
+        struct hipi_ups_policy_ctx __ctx;                               \
+        struct hipi_ups_ops *__ops;                                     \
+        s32 __ret = (def);                                              \
+                                                                        \
+        rcu_read_lock();                                                \
+        __ops = rcu_dereference(hipi_ups_policy);                       \
+        if (__ops && __ops->op) {                                       \
+            hipi_ups_policy_ctx_fill(data, &__ctx, def);                \
+            __ret = __ops->op(&__ctx);                                  \
+        }                                                               \
+        rcu_read_unlock();                                              \
+        __ret;                                                          \
+    })
+
+s32 hipi_ups_policy_on_battery(struct gpio_data *data, s32 def)
+{
+    return HIPI_UPS_POLICY_CALL(data, on_battery, def);
+}
+
+s32 hipi_ups_policy_heartbeat_lost(struct gpio_data *data, s32 def)
+{
+    return HIPI_UPS_POLICY_CALL(data, heartbeat_lost, def);
+}
+
+s32 hipi_ups_policy_countdown_expired(struct gpio_data *data, s32 def)
+{
+    return HIPI_UPS_POLICY_CALL(data, countdown_expired, def);
+}
+
+void hipi_ups_policy_restored(struct gpio_data *data)
+{
+    struct hipi_ups_policy_ctx ctx;
+    struct hipi_ups_ops *ops;
+
+    rcu_read_lock();
+    ops = rcu_dereference(hipi_ups_policy);
+    if (ops && ops->restored) {
+        hipi_ups_policy_ctx_fill(data, &ctx, 0);
+        ops->restored(&ctx);
+    }
+    rcu_read_unlock();
+}
+
+/* --- struct_ops plumbing --- */
+
+static int hipi_ups_bpf_btf_init(struct btf *btf)
+{
+    return 0;
+}
+
+static bool hipi_ups_bpf_is_valid_access(int off, int size, enum bpf_access_type type,
+                                         const struct bpf_prog *prog, struct bpf_insn_access_aux *info)
+{
+    return bpf_tracing_btf_ctx_access(off, size, type, prog, info);
+}
+
+static const struct bpf_func_proto *hipi_ups_bpf_get_func_proto(enum bpf_func_id func_id,
+                                                                const struct bpf_prog *prog)
+{
+    return bpf_base_func_proto(func_id, prog);
+}
+
+static const struct bpf_verifier_ops hipi_ups_bpf_verifier_ops = {
+    .is_valid_access = hipi_ups_bpf_is_valid_access,
+    .get_func_proto = hipi_ups_bpf_get_func_proto,
+};
+
+static int hipi_ups_bpf_init_member(const struct btf_type *t, const struct btf_member *member,
+                                    void *kdata, const void *udata)
+{
+    const struct hipi_ups_ops *uops = udata;
+    struct hipi_ups_ops *ops = kdata;
+
+    if (__btf_member_bit_offset(t, member) / 8 != offsetof(struct hipi_ups_ops, name)) return 0;
+    if (bpf_obj_name_cpy(ops->name, uops->name, sizeof(ops->name)) <= 0) return -EINVAL;
+    return 1;
+}
+
+/* One policy at a time */
+static int hipi_ups_bpf_reg(void *kdata, struct bpf_link *link)
+{
+    struct hipi_ups_ops *ops = kdata;
+
+    if (cmpxchg((struct hipi_ups_ops **)&hipi_ups_policy, NULL, ops)) return -EEXIST;
+    pr_info("hipi-ups: Shutdown policy \"%s\" attached\n", ops->name);
+    return 0;
+}
+
+static void hipi_ups_bpf_unreg(void *kdata, struct bpf_link *link)
+{
+    struct hipi_ups_ops *ops = kdata;
+
+    if (cmpxchg((struct hipi_ups_ops **)&hipi_ups_policy, ops, NULL) != ops) return;
+    synchronize_rcu();
+    pr_info("hipi-ups: Shutdown policy \"%s\" detached\n", ops->name);
+}
+
+/* CFI stubs: the signatures struct_ops trampolines are checked against */
+static s32 hipi_ups_ops__on_battery(const struct hipi_ups_policy_ctx *ctx) { return 0; }
+static s32 hipi_ups_ops__heartbeat_lost(const struct hipi_ups_policy_ctx *ctx) { return 0; }
+static s32 hipi_ups_ops__countdown_expired(const struct hipi_ups_policy_ctx *ctx) { return 0; }
+static void hipi_ups_ops__restored(const struct hipi_ups_policy_ctx *ctx) { }
+
+static struct hipi_ups_ops __bpf_hipi_ups_ops = {
+    .on_battery = hipi_ups_ops__on_battery,
+    .heartbeat_lost = hipi_ups_ops__heartbeat_lost,
+    .countdown_expired = hipi_ups_ops__countdown_expired,
+    .restored = hipi_ups_ops__restored,
+};
+
+static struct bpf_struct_ops bpf_hipi_ups_ops = {
+    .verifier_ops = &hipi_ups_bpf_verifier_ops,
+    .init = hipi_ups_bpf_btf_init,
+    .init_member = hipi_ups_bpf_init_member,
+    .reg = hipi_ups_bpf_reg,
+    .unreg = hipi_ups_bpf_unreg,
+    .cfi_stubs = &__bpf_hipi_ups_ops,
+    .name = "hipi_ups_ops",
+    .owner = THIS_MODULE,
+};
+
+/* Must run from module init so the type is found in the module's BTF */
+int hipi_ups_bpf_init(void)
+{
+    return register_bpf_struct_ops(&bpf_hipi_ups_ops, hipi_ups_ops);
+}
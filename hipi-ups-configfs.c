@@ -0,0 +1,432 @@
+#include <linux/bitops.h>
+#include <linux/configfs.h>
+#include <linux/err.h>
+#include <linux/gpio/machine.h>
+#include <linux/idr.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/platform_device.h>
+#include <linux/property.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "hipi-ups.h"
+
+/* Instances created at runtime, for boards without a usable DT and for test
+ * rigs (e.g. against gpio-sim):
+ *
+ *   mkdir /sys/kernel/config/hipi-ups/ups0
+ *   cd /sys/kernel/config/hipi-ups/ups0
+ *   echo gpio_ups > board
+ *   echo gpio-sim.0-node0:0 > power_gpio
+ *   echo 1 > enable
+ *
+ * The directory name becomes the instance label. Lines are named by GPIO chip
+ * label and offset, with an optional ":active-low" suffix, and handed to the
+ * driver through a GPIO lookup table; the timing parameters become device
+ * properties, so probe sees the same thing it would from DT.
+ */
+
+enum hipi_ups_cfs_line {
+    HIPI_UPS_CFS_POWER,
+    HIPI_UPS_CFS_STATUS,
+    HIPI_UPS_CFS_ONLINE,
+    HIPI_UPS_CFS_BATTERY_LOW,
+    HIPI_UPS_CFS_CHARGING,
+    HIPI_UPS_CFS_LINE_COUNT,
+};
+
+/* GPIO con_ids, as in the DT "<con_id>-gpios" properties */
+static const char * const hipi_ups_cfs_con_ids[HIPI_UPS_CFS_LINE_COUNT] = {
+    [HIPI_UPS_CFS_POWER] = "power",
+    [HIPI_UPS_CFS_STATUS] = "status",
+    [HIPI_UPS_CFS_ONLINE] = "online",
+    [HIPI_UPS_CFS_BATTERY_LOW] = "battery-low",
+    [HIPI_UPS_CFS_CHARGING] = "charging",
+};
+
+enum hipi_ups_cfs_param {
+    HIPI_UPS_CFS_SHUTDOWN_DELAY,
+    HIPI_UPS_CFS_HEARTBEAT_TIMEOUT,
+    HIPI_UPS_CFS_HEARTBEAT_RECOVER,
+    HIPI_UPS_CFS_FLAP_WINDOW,
+    HIPI_UPS_CFS_FLAP_THRESHOLD,
+    HIPI_UPS_CFS_STATUS_PERIOD,
+    HIPI_UPS_CFS_RESTORE_STABLE,
+    HIPI_UPS_CFS_PARAM_COUNT,
+};
+
+/* Device properties the driver reads in probe */
+static const char * const hipi_ups_cfs_props[HIPI_UPS_CFS_PARAM_COUNT] = {
+    [HIPI_UPS_CFS_SHUTDOWN_DELAY] = "shutdown-delay-ms",
+    [HIPI_UPS_CFS_HEARTBEAT_TIMEOUT] = "heartbeat-timeout-ms",
+    [HIPI_UPS_CFS_HEARTBEAT_RECOVER] = "heartbeat-recover-ms",
+    [HIPI_UPS_CFS_FLAP_WINDOW] = "heartbeat-flap-window-ms",
+    [HIPI_UPS_CFS_FLAP_THRESHOLD] = "heartbeat-flap-threshold",
+    [HIPI_UPS_CFS_STATUS_PERIOD] = "status-period-ms",
+    [HIPI_UPS_CFS_RESTORE_STABLE] = "restore-stable-ms",
+};
+
+struct hipi_ups_cfs_gpio {
+    char chip[32]; /* GPIO chip label, empty if not connected */
+    u16 offset;
+    bool active_low;
+};
+
+struct hipi_ups_cfs {
+    struct config_item item;
+    struct mutex lock; /* Protects everything below */
+    char board[PLATFORM_NAME_SIZE]; /* A hipi_ups_id_table name */
+    struct hipi_ups_cfs_gpio lines[HIPI_UPS_CFS_LINE_COUNT];
+    u32 params[HIPI_UPS_CFS_PARAM_COUNT];
+    unsigned long params_set; /* Bitmap over enum hipi_ups_cfs_param; unset ones keep the board default */
+    struct platform_device *pdev; /* Non-NULL while enabled */
+    struct gpiod_lookup_table *lookup;
+    int id;
+};
+
+static DEFINE_IDA(hipi_ups_cfs_ida);
+
+static struct hipi_ups_cfs *to_hipi_ups_cfs(struct config_item *item)
+{
+    return container_of(item, struct hipi_ups_cfs, item);
+}
+
+static int hipi_ups_cfs_enable(struct hipi_ups_cfs *cfs)
+{
+    struct property_entry props[HIPI_UPS_CFS_PARAM_COUNT + 2] = { };
+    struct platform_device_info info = { };
+    struct gpiod_lookup_table *lookup;
+    unsigned int i, n = 0;
+    int ret;
+
+    if (!cfs->lines[HIPI_UPS_CFS_POWER].chip[0]) return -EINVAL;
+
+    cfs->id = ida_alloc(&hipi_ups_cfs_ida, GFP_KERNEL);
+    if (cfs->id < 0) return cfs->id;
+
+    lookup = kzalloc(struct_size(lookup, table, HIPI_UPS_CFS_LINE_COUNT + 1), GFP_KERNEL);
+    if (!lookup) {
+        ret = -ENOMEM;
+        goto err_id;
+    }
+    /* Platform devices with an id are named "<name>.<id>" */
+    lookup->dev_id = kasprintf(GFP_KERNEL, "%s.%d", cfs->board, cfs->id);
+    if (!lookup->dev_id) {
+        ret = -ENOMEM;
+        goto err_lookup;
+    }
+    for (i = 0; i < HIPI_UPS_CFS_LINE_COUNT; i++) {
+        if (!cfs->lines[i].chip[0]) continue;
+        lookup->table[n++] = GPIO_LOOKUP(cfs->lines[i].chip, cfs->lines[i].offset, hipi_ups_cfs_con_ids[i],
+                                         cfs->lines[i].active_low ? GPIO_ACTIVE_LOW : GPIO_ACTIVE_HIGH);
+    }
+    gpiod_add_lookup_table(lookup);
+
+    n = 0;
+    props[n++] = PROPERTY_ENTRY_STRING("label", config_item_name(&cfs->item));
+    for (i = 0; i < HIPI_UPS_CFS_PARAM_COUNT; i++)
+        if (test_bit(i, &cfs->params_set)) props[n++] = PROPERTY_ENTRY_U32(hipi_ups_cfs_props[i], cfs->params[i]);
+
+    info.name = cfs->board;
+    info.id = cfs->id;
+    info.properties = props; /* Copied into the device's software node */
+    cfs->pdev = platform_device_register_full(&info);
+    if (IS_ERR(cfs->pdev)) {
+        ret = PTR_ERR(cfs->pdev);
+        cfs->pdev = NULL;
+        goto err_table;
+    }
+
+    cfs->lookup = lookup;
+    return 0;
+
+err_table:
+    gpiod_remove_lookup_table(lookup);
+    kfree(lookup->dev_id);
+err_lookup:
+    kfree(lookup);
+err_id:
+    ida_free(&hipi_ups_cfs_ida, cfs->id);
+    return ret;
+}
+
+static void hipi_ups_cfs_disable(struct hipi_ups_cfs *cfs)
+{
+    platform_device_unregister(cfs->pdev);
+    cfs->pdev = NULL;
+    gpiod_remove_lookup_table(cfs->lookup);
+    kfree(cfs->lookup->dev_id);
+    kfree(cfs->lookup);
+    cfs->lookup = NULL;
+    ida_free(&hipi_ups_cfs_ida, cfs->id);
+}
+
+/* --- Attributes --- */
+
+static ssize_t hipi_ups_cfs_line_show(struct hipi_ups_cfs *cfs, enum hipi_ups_cfs_line line, char *page)
+{
+    struct hipi_ups_cfs_gpio *gpio = &cfs->lines[line];
+    ssize_t ret = 0;
+
+    mutex_lock(&cfs->lock);
+    if (gpio->chip[0])
+        ret = sprintf(page, "%s:%u%s\n", gpio->chip, gpio->offset, gpio->active_low ? ":active-low" : "");
+    mutex_unlock(&cfs->lock);
+    return ret;
+}
+
+/* "<chip>:<offset>[:active-low]", or empty to disconnect the line */
+static ssize_t hipi_ups_cfs_line_store(struct hipi_ups_cfs *cfs, enum hipi_ups_cfs_line line,
+                                       const char *page, size_t len)
+{
+    struct hipi_ups_cfs_gpio gpio = { };
+    char buf[48], *str, *sep;
+    size_t n;
+    int ret;
+
+    if (len >= sizeof(buf)) return -EINVAL;
+    memcpy(buf, page, len);
+    buf[len] = '\0';
+    str = strim(buf);
+
+    if (*str) {
+        n = strlen(str);
+        if (n > 11 && !strcmp(str + n - 11, ":active-low")) {
+            gpio.active_low = true;
+            str[n - 11] = '\0';
+        }
+        sep = strrchr(str, ':');
+        if (!sep || sep == str) return -EINVAL;
+        *sep = '\0';
+        ret = kstrtou16(sep + 1, 0, &gpio.offset);
+        if (ret) return ret;
+        if (strscpy(gpio.chip, str, sizeof(gpio.chip)) < 0) return -EINVAL;
+    }
+
+    mutex_lock(&cfs->lock);
+    if (cfs->pdev) {
+        mutex_unlock(&cfs->lock);
+        return -EBUSY;
+    }
+    cfs->lines[line] = gpio;
+    mutex_unlock(&cfs->lock);
+    return len;
+}
+
+#define HIPI_UPS_CFS_LINE_ATTR(_name, _line)                                                          \
+    static ssize_t hipi_ups_cfs_##_name##_show(struct config_item *item, char *page)                  \
+    {                                                                                                 \
+        return hipi_ups_cfs_line_show(to_hipi_ups_cfs(item), _line, page);                            \
+    }                                                                                                 \
+    static ssize_t hipi_ups_cfs_##_name##_store(struct config_item *item, const char *page, size_t len) \
+    {                                                                                                 \
+        return hipi_ups_cfs_line_store(to_hipi_ups_cfs(item), _line, page, len);                      \
+    }                                                                                                 \
+    CONFIGFS_ATTR(hipi_ups_cfs_, _name)
+
+HIPI_UPS_CFS_LINE_ATTR(power_gpio, HIPI_UPS_CFS_POWER);
+HIPI_UPS_CFS_LINE_ATTR(status_gpio, HIPI_UPS_CFS_STATUS);
+HIPI_UPS_CFS_LINE_ATTR(online_gpio, HIPI_UPS_CFS_ONLINE);
+HIPI_UPS_CFS_LINE_ATTR(battery_low_gpio, HIPI_UPS_CFS_BATTERY_LOW);
+HIPI_UPS_CFS_LINE_ATTR(charging_gpio, HIPI_UPS_CFS_CHARGING);
+
+static ssize_t hipi_ups_cfs_param_show(struct hipi_ups_cfs *cfs, enum hipi_ups_cfs_param param, char *page)
+{
+    ssize_t ret = 0;
+
+    mutex_lock(&cfs->lock);
+    if (test_bit(param, &cfs->params_set)) ret = sprintf(page, "%u\n", cfs->params[param]);
+    mutex_unlock(&cfs->lock);
+    return ret;
+}
+
+static ssize_t hipi_ups_cfs_param_store(struct hipi_ups_cfs *cfs, enum hipi_ups_cfs_param param,
+                                        const char *page, size_t len)
+{
+    u32 val;
+    int ret;
+
+    ret = kstrtou32(page, 0, &val);
+    if (ret) return ret;
+
+    mutex_lock(&cfs->lock);
+    if (cfs->pdev) {
+        mutex_unlock(&cfs->lock);
+        return -EBUSY;
+    }
+    cfs->params[param] = val;
+    set_bit(param, &cfs->params_set);
+    mutex_unlock(&cfs->lock);
+    return len;
+}
+
+#define HIPI_UPS_CFS_PARAM_ATTR(_name, _param)                                                        \
+    static ssize_t hipi_ups_cfs_##_name##_show(struct config_item *item, char *page)                  \
+    {                                                                                                 \
+        return hipi_ups_cfs_param_show(to_hipi_ups_cfs(item), _param, page);                          \
+    }                                                                                                 \
+    static ssize_t hipi_ups_cfs_##_name##_store(struct config_item *item, const char *page, size_t len) \
+    {                                                                                                 \
+        return hipi_ups_cfs_param_store(to_hipi_ups_cfs(item), _param, page, len);                    \
+    }                                                                                                 \
+    CONFIGFS_ATTR(hipi_ups_cfs_, _name)
+
+HIPI_UPS_CFS_PARAM_ATTR(shutdown_delay_ms, HIPI_UPS_CFS_SHUTDOWN_DELAY);
+HIPI_UPS_CFS_PARAM_ATTR(heartbeat_timeout_ms, HIPI_UPS_CFS_HEARTBEAT_TIMEOUT);
+HIPI_UPS_CFS_PARAM_ATTR(heartbeat_recover_ms, HIPI_UPS_CFS_HEARTBEAT_RECOVER);
+HIPI_UPS_CFS_PARAM_ATTR(heartbeat_flap_window_ms, HIPI_UPS_CFS_FLAP_WINDOW);
+HIPI_UPS_CFS_PARAM_ATTR(heartbeat_flap_threshold, HIPI_UPS_CFS_FLAP_THRESHOLD);
+HIPI_UPS_CFS_PARAM_ATTR(status_period_ms, HIPI_UPS_CFS_STATUS_PERIOD);
+HIPI_UPS_CFS_PARAM_ATTR(restore_stable_ms, HIPI_UPS_CFS_RESTORE_STABLE);
+
+static ssize_t hipi_ups_cfs_board_show(struct config_item *item, char *page)
+{
+    struct hipi_ups_cfs *cfs = to_hipi_ups_cfs(item);
+    ssize_t ret;
+
+    mutex_lock(&cfs->lock);
+    ret = sprintf(page, "%s\n", cfs->board);
+    mutex_unlock(&cfs->lock);
+    return ret;
+}
+
+/* One of the names in hipi_ups_id_table */
+static ssize_t hipi_ups_cfs_board_store(struct config_item *item, const char *page, size_t len)
+{
+    struct hipi_ups_cfs *cfs = to_hipi_ups_cfs(item);
+    const struct platform_device_id *id;
+
+    for (id = hipi_ups_id_table; id->name[0]; id++)
+        if (sysfs_streq(page, id->name)) break;
+    if (!id->name[0]) return -EINVAL;
+
+    mutex_lock(&cfs->lock);
+    if (cfs->pdev) {
+        mutex_unlock(&cfs->lock);
+        return -EBUSY;
+    }
+    strscpy(cfs->board, id->name, sizeof(cfs->board));
+    mutex_unlock(&cfs->lock);
+    return len;
+}
+CONFIGFS_ATTR(hipi_ups_cfs_, board);
+
+static ssize_t hipi_ups_cfs_enable_show(struct config_item *item, char *page)
+{
+    struct hipi_ups_cfs *cfs = to_hipi_ups_cfs(item);
+    ssize_t ret;
+
+    mutex_lock(&cfs->lock);
+    ret = sprintf(page, "%d\n", cfs->pdev != NULL);
+    mutex_unlock(&cfs->lock);
+    return ret;
+}
+
+/* Probing happens asynchronously; check dmesg or the device's sysfs
+ * directory to see whether it bound.
+ */
+static ssize_t hipi_ups_cfs_enable_store(struct config_item *item, const char *page, size_t len)
+{
+    struct hipi_ups_cfs *cfs = to_hipi_ups_cfs(item);
+    bool enable;
+    int ret;
+
+    ret = kstrtobool(page, &enable);
+    if (ret) return ret;
+
+    mutex_lock(&cfs->lock);
+    if (enable && !cfs->pdev) ret = hipi_ups_cfs_enable(cfs);
+    else if (!enable && cfs->pdev) hipi_ups_cfs_disable(cfs);
+    mutex_unlock(&cfs->lock);
+    return ret ? ret : len;
+}
+CONFIGFS_ATTR(hipi_ups_cfs_, enable);
+
+static struct configfs_attribute *hipi_ups_cfs_attrs[] = {
+    &hipi_ups_cfs_attr_board,
+    &hipi_ups_cfs_attr_power_gpio,
+    &hipi_ups_cfs_attr_status_gpio,
+    &hipi_ups_cfs_attr_online_gpio,
+    &hipi_ups_cfs_attr_battery_low_gpio,
+    &hipi_ups_cfs_attr_charging_gpio,
+    &hipi_ups_cfs_attr_shutdown_delay_ms,
+    &hipi_ups_cfs_attr_heartbeat_timeout_ms,
+    &hipi_ups_cfs_attr_heartbeat_recover_ms,
+    &hipi_ups_cfs_attr_heartbeat_flap_window_ms,
+    &hipi_ups_cfs_attr_heartbeat_flap_threshold,
+    &hipi_ups_cfs_attr_status_period_ms,
+    &hipi_ups_cfs_attr_restore_stable_ms,
+    &hipi_ups_cfs_attr_enable,
+    NULL
+};
+
+/* --- Items --- */
+
+static void hipi_ups_cfs_release(struct config_item *item)
+{
+    struct hipi_ups_cfs *cfs = to_hipi_ups_cfs(item);
+
+    mutex_destroy(&cfs->lock);
+    kfree(cfs);
+}
+
+static struct configfs_item_operations hipi_ups_cfs_item_ops = {
+    .release = hipi_ups_cfs_release,
+};
+
+static const struct config_item_type hipi_ups_cfs_item_type = {
+    .ct_item_ops = &hipi_ups_cfs_item_ops,
+    .ct_attrs = hipi_ups_cfs_attrs,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct config_item *hipi_ups_cfs_make_item(struct config_group *group, const char *name)
+{
+    struct hipi_ups_cfs *cfs;
+
+    cfs = kzalloc(sizeof(*cfs), GFP_KERNEL);
+    if (!cfs) return ERR_PTR(-ENOMEM);
+
+    mutex_init(&cfs->lock);
+    strscpy(cfs->board, hipi_ups_id_table[0].name, sizeof(cfs->board));
+    config_item_init_type_name(&cfs->item, name, &hipi_ups_cfs_item_type);
+    return &cfs->item;
+}
+
+/* rmdir: take the instance down before the item goes */
+static void hipi_ups_cfs_drop_item(struct config_group *group, struct config_item *item)
+{
+    struct hipi_ups_cfs *cfs = to_hipi_ups_cfs(item);
+
+    mutex_lock(&cfs->lock);
+    if (cfs->pdev) hipi_ups_cfs_disable(cfs);
+    mutex_unlock(&cfs->lock);
+
+    config_item_put(item);
+}
+
+static struct configfs_group_operations hipi_ups_cfs_group_ops = {
+    .make_item = hipi_ups_cfs_make_item,
+    .drop_item = hipi_ups_cfs_drop_item,
+};
+
+static const struct config_item_type hipi_ups_cfs_group_type = {
+    .ct_group_ops = &hipi_ups_cfs_group_ops,
+    .ct_owner = THIS_MODULE,
+};
+
+static struct configfs_subsystem hipi_ups_cfs_subsys;
+
+int hipi_ups_configfs_init(void)
+{
+    config_group_init_type_name(&hipi_ups_cfs_subsys.su_group, "hipi-ups", &hipi_ups_cfs_group_type);
+    mutex_init(&hipi_ups_cfs_subsys.su_mutex);
+    return configfs_register_subsystem(&hipi_ups_cfs_subsys);
+}
+
+void hipi_ups_configfs_exit(void)
+{
+    configfs_unregister_subsystem(&hipi_ups_cfs_subsys);
+}
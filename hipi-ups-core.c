@@ -0,0 +1,1647 @@
+#include <linux/module.h>       /* Essential for all modules */
+#include <linux/platform_device.h> /* For platform_driver and platform_device */
+#include <linux/gpio/consumer.h>   /* For gpiod_* functions */
+#include <linux/interrupt.h>       /* For request_irq and irqreturn_t */
+#include <linux/of.h>          /* Core Device Tree support */
+#include <linux/slab.h>        /* For devm_kzalloc and memory management */
+#include <linux/workqueue.h>   /* Required for delayed_work */
+#include <linux/reboot.h>      /* Required for orderly_poweroff and the sys-off handler */
+#include <linux/timer.h>       /* Required for watchdog timer */
+#include <linux/devm-helpers.h> /* For devm_delayed_work_autocancel */
+#include <linux/idr.h>         /* For per-instance index allocation */
+#include <linux/property.h>    /* For device_property_read_string */
+#include <linux/sysfs.h>       /* For state attributes and sysfs_notify */
+#include <linux/list.h>        /* For the host-wide instance list */
+#include <linux/mutex.h>
+#include <linux/moduleparam.h>
+#include <linux/spinlock.h>
+#include <linux/timekeeping.h>
+#include <linux/power_supply.h>
+#include <linux/ratelimit.h>
+#include <linux/printk.h>
+#include <linux/pm.h>
+#include <linux/pm_wakeup.h>
+
+#include "hipi-ups.h"
+
+#ifdef CONFIG_HIPI_UPS_TRACEPOINTS
+#define CREATE_TRACE_POINTS
+#include "hipi-ups-trace.h"
+#else
+static inline void trace_hipi_ups_power_latency(const char *name, u64 latency_us, bool slo_missed) { }
+#endif
+
+MODULE_DESCRIPTION("Hipi UPS Driver");
+MODULE_AUTHOR("Clayton Watts <cletusw@gmail.com>");
+MODULE_LICENSE("Dual MIT/GPL");
+
+#define SAMPLE_INTERVAL_MS 1000 /* Poll rate for optional lines without an IRQ */
+#define HEARTBEAT_FLAP_WINDOW_MS 60000 /* Default window for heartbeat flap detection */
+#define HEARTBEAT_FLAP_THRESHOLD 6     /* Default raw transitions per window that count as flapping */
+#define SHUTDOWN_WARNINGS_MAX 8        /* Entries in shutdown_warnings_ms */
+
+static unsigned int shutdown_quorum;
+module_param(shutdown_quorum, uint, 0644);
+MODULE_PARM_DESC(shutdown_quorum,
+                 "Number of UPS instances whose power failure must have persisted before powering off (0 = all)");
+
+/* Under flapping power, per-edge messages can flood a slow serial console.
+ * Each message class has its own console level and ratelimit; suppressed
+ * messages are counted and summarised with the next one that gets through.
+ */
+static int log_level_power = LOGLEVEL_WARNING;
+module_param(log_level_power, int, 0644);
+MODULE_PARM_DESC(log_level_power, "Console level for power lost/restored messages (0-7)");
+
+static int log_level_heartbeat_lost = LOGLEVEL_CRIT;
+module_param(log_level_heartbeat_lost, int, 0644);
+MODULE_PARM_DESC(log_level_heartbeat_lost, "Console level for UPS heartbeat missing messages (0-7)");
+
+static int log_level_heartbeat = LOGLEVEL_INFO;
+module_param(log_level_heartbeat, int, 0644);
+MODULE_PARM_DESC(log_level_heartbeat, "Console level for UPS heartbeat detected messages (0-7)");
+
+static int log_level_battery = LOGLEVEL_WARNING;
+module_param(log_level_battery, int, 0644);
+MODULE_PARM_DESC(log_level_battery, "Console level for battery low/charging messages (0-7)");
+
+static int log_level_latency = LOGLEVEL_WARNING;
+module_param(log_level_latency, int, 0644);
+MODULE_PARM_DESC(log_level_latency, "Console level for power fault latency SLO misses (0-7)");
+
+static unsigned int log_ratelimit_ms = 5000;
+module_param(log_ratelimit_ms, uint, 0444);
+MODULE_PARM_DESC(log_ratelimit_ms, "Ratelimit interval for each message class, per instance");
+
+static unsigned int log_ratelimit_burst = 5;
+module_param(log_ratelimit_burst, uint, 0444);
+MODULE_PARM_DESC(log_ratelimit_burst, "Messages of each class allowed per ratelimit interval, per instance");
+
+static int *const hipi_ups_log_levels[HIPI_UPS_LOG_COUNT] = {
+    [HIPI_UPS_LOG_POWER] = &log_level_power,
+    [HIPI_UPS_LOG_HEARTBEAT_LOST] = &log_level_heartbeat_lost,
+    [HIPI_UPS_LOG_HEARTBEAT] = &log_level_heartbeat,
+    [HIPI_UPS_LOG_BATTERY] = &log_level_battery,
+    [HIPI_UPS_LOG_LATENCY] = &log_level_latency,
+};
+
+const char * const hipi_ups_log_class_names[HIPI_UPS_LOG_COUNT] = {
+    [HIPI_UPS_LOG_POWER] = "power",
+    [HIPI_UPS_LOG_HEARTBEAT_LOST] = "heartbeat_lost",
+    [HIPI_UPS_LOG_HEARTBEAT] = "heartbeat",
+    [HIPI_UPS_LOG_BATTERY] = "battery",
+    [HIPI_UPS_LOG_LATENCY] = "latency",
+};
+
+static __printf(3, 4) void hipi_ups_log(struct gpio_data *data, enum hipi_ups_log_class cls,
+                                        const char *fmt, ...)
+{
+    char level[] = KERN_SOH "0";
+    struct va_format vaf;
+    unsigned int suppressed;
+    unsigned long flags;
+    va_list args;
+    bool print;
+
+    print = __ratelimit(&data->log_rs[cls]);
+
+    spin_lock_irqsave(&data->lock, flags);
+    if (print) {
+        suppressed = data->log_pending[cls];
+        data->log_pending[cls] = 0;
+    } else {
+        data->log_pending[cls]++;
+        data->stats.log_suppressed[cls]++;
+    }
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    if (!print) return;
+
+    level[1] += clamp(READ_ONCE(*hipi_ups_log_levels[cls]), LOGLEVEL_EMERG, LOGLEVEL_DEBUG);
+    if (suppressed)
+        dev_printk(level, data->dev, "%u %s messages suppressed\n",
+                   suppressed, hipi_ups_log_class_names[cls]);
+
+    va_start(args, fmt);
+    vaf.fmt = fmt;
+    vaf.va = &args;
+    dev_printk(level, data->dev, "%pV", &vaf);
+    va_end(args);
+}
+
+/* Log what happened according to a hipi-ups-logic.h decision */
+static void hipi_ups_log_action(struct gpio_data *data, enum hipi_ups_log_class cls,
+                                const struct hipi_ups_action *act)
+{
+    if (!act->msg) return;
+    if (act->alert) dev_alert(data->dev, act->msg, act->ms);
+    else hipi_ups_log(data, cls, act->msg, act->ms);
+}
+
+/* A power fault edge should be acted on within a few ms even under load */
+static unsigned int power_latency_slo_us = 2000;
+module_param(power_latency_slo_us, uint, 0644);
+MODULE_PARM_DESC(power_latency_slo_us,
+                 "Warn when a power fault edge waits longer than this for its handler (0 = never)");
+
+const u32 hipi_ups_latency_bounds_us[HIPI_UPS_LATENCY_BUCKETS - 1] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+};
+
+/* Warn userspace ahead of a poweroff: a change uevent with
+ * HIPI_UPS_EVENT=shutdown_warning at each of these times before the
+ * countdown runs out, and HIPI_UPS_EVENT=shutdown_imminent at the final one.
+ */
+static unsigned int shutdown_warnings_ms[SHUTDOWN_WARNINGS_MAX] = { 30000, 10000 };
+static unsigned int shutdown_warnings_count = 2;
+module_param_array(shutdown_warnings_ms, uint, &shutdown_warnings_count, 0644);
+MODULE_PARM_DESC(shutdown_warnings_ms, "Send a shutdown warning this long before poweroff (comma-separated ms)");
+
+static unsigned int shutdown_final_warning_ms = 5000;
+module_param(shutdown_final_warning_ms, uint, 0644);
+MODULE_PARM_DESC(shutdown_final_warning_ms, "Send the final shutdown warning this long before poweroff (0 = never)");
+
+static bool shutdown_broadcast = true;
+module_param(shutdown_broadcast, bool, 0644);
+MODULE_PARM_DESC(shutdown_broadcast, "Also print shutdown warnings to every console at KERN_EMERG");
+
+/* Edges can be lost to a glitching GPIO controller or while an IRQ is being
+ * set up, leaving the state out of step with the lines until the next edge.
+ */
+static unsigned int reconcile_interval_ms = 10000;
+module_param(reconcile_interval_ms, uint, 0444);
+MODULE_PARM_DESC(reconcile_interval_ms, "Check the line levels against the driver's state this often (0 = never)");
+
+/* orderly_poweroff() can't be called off, so if mains returns while it runs
+ * the host would stay off with power available until someone intervenes.
+ */
+static bool restart_on_mains_return = true;
+module_param(restart_on_mains_return, bool, 0644);
+MODULE_PARM_DESC(restart_on_mains_return, "Restart instead of powering off if mains returns during our shutdown");
+
+/* A shutdown policy may hold off or extend the countdown, but without a
+ * battery-low line nothing else stops a buggy one running the battery flat.
+ */
+static unsigned int policy_max_extension_ms = 600000;
+module_param(policy_max_extension_ms, uint, 0644);
+MODULE_PARM_DESC(policy_max_extension_ms,
+                 "Longest a shutdown policy may keep the host on battery beyond the shutdown delay");
+
+static bool hipi_ups_poweroff_started; /* We called orderly_poweroff() */
+static struct sys_off_handler *hipi_ups_sys_off;
+
+static DEFINE_IDA(hipi_ups_ida);
+
+/* All probed instances. A host on redundant supplies only powers off once
+ * shutdown_quorum of them have been without power for their shutdown delay.
+ */
+LIST_HEAD(hipi_ups_instances);
+DEFINE_MUTEX(hipi_ups_lock);
+
+static s64 hipi_ups_now_ms(void)
+{
+    return ktime_to_ms(ktime_get_boottime());
+}
+
+static void hipi_ups_count_edge(struct gpio_data *data, enum hipi_ups_line line)
+{
+    unsigned long flags;
+
+    if (!IS_ENABLED(CONFIG_HIPI_UPS_STATS)) return;
+    spin_lock_irqsave(&data->lock, flags);
+    data->stats.edges[line]++;
+    spin_unlock_irqrestore(&data->lock, flags);
+}
+
+static void hipi_ups_warn(struct gpio_data *data, const char *event, s64 remaining_ms)
+{
+    char name_env[64], event_env[48], remaining_env[48];
+    char *envp[] = { name_env, event_env, remaining_env, NULL };
+
+    snprintf(name_env, sizeof(name_env), "HIPI_UPS_NAME=%s", data->name);
+    snprintf(event_env, sizeof(event_env), "HIPI_UPS_EVENT=%s", event);
+    snprintf(remaining_env, sizeof(remaining_env), "HIPI_UPS_SHUTDOWN_IN_MS=%lld", remaining_ms);
+    kobject_uevent_env(&data->dev->kobj, KOBJ_CHANGE, envp);
+}
+
+/* Decide whether the host as a whole should power off by the boottime ms
+ * "by": whether shutdown_quorum instances are exhausted, counting those whose
+ * countdown runs out by then (none if by is 0). Caller holds hipi_ups_lock.
+ */
+static bool hipi_ups_host_should_poweroff(s64 by, unsigned int *down, unsigned int *total)
+{
+    struct gpio_data *data;
+    unsigned long flags;
+    bool due;
+
+    *down = 0;
+    *total = 0;
+    list_for_each_entry(data, &hipi_ups_instances, node) {
+        spin_lock_irqsave(&data->lock, flags);
+        due = data->shutdown_deadline && data->shutdown_deadline <= by;
+        spin_unlock_irqrestore(&data->lock, flags);
+        (*total)++;
+        if (data->exhausted || due) (*down)++;
+    }
+
+    return hipi_ups_quorum_met(*down, *total, shutdown_quorum);
+}
+
+/* Re-run every instance's warning stages after a change that can move the
+ * host's poweroff, since each instance's stages depend on the others.
+ */
+static void hipi_ups_host_warn_update(void)
+{
+    struct gpio_data *data;
+
+    mutex_lock(&hipi_ups_lock);
+    list_for_each_entry(data, &hipi_ups_instances, node)
+        mod_delayed_work(system_wq, &data->warn_work, 0);
+    mutex_unlock(&hipi_ups_lock);
+}
+
+/* Send the most urgent warning stage that has come due, then sleep until the
+ * next one. Re-run whenever the deadline moves; only the latest of several
+ * stages passed at once is sent. Stages are only sent while this countdown
+ * running out would actually power the host off under shutdown_quorum;
+ * otherwise they stay due in case another instance's countdown changes that.
+ */
+static void warn_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, warn_work.work);
+    unsigned int count = min_t(unsigned int, READ_ONCE(shutdown_warnings_count), SHUTDOWN_WARNINGS_MAX);
+    unsigned int final = READ_ONCE(shutdown_final_warning_ms);
+    unsigned int due = 0, next = 0, stage, i, down, total;
+    unsigned long flags;
+    s64 remaining, deadline;
+    bool poweroff;
+
+    spin_lock_irqsave(&data->lock, flags);
+    deadline = data->shutdown_deadline;
+    spin_unlock_irqrestore(&data->lock, flags);
+    if (!deadline) return;
+
+    mutex_lock(&hipi_ups_lock);
+    poweroff = hipi_ups_host_should_poweroff(deadline, &down, &total);
+    mutex_unlock(&hipi_ups_lock);
+
+    spin_lock_irqsave(&data->lock, flags);
+    if (!data->shutdown_deadline) {
+        spin_unlock_irqrestore(&data->lock, flags);
+        return;
+    }
+    remaining = data->shutdown_deadline - hipi_ups_now_ms();
+    for (i = 0; i <= count; i++) {
+        stage = i < count ? READ_ONCE(shutdown_warnings_ms[i]) : final;
+        if (!stage || stage >= data->warn_sent_ms) continue;
+        if (stage >= remaining) due = due ? min(due, stage) : stage;
+        else next = max(next, stage);
+    }
+    if (!poweroff) due = 0;
+    if (due) data->warn_sent_ms = due;
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    remaining = max_t(s64, remaining, 0);
+    if (due) {
+        hipi_ups_warn(data, due == final ? "shutdown_imminent" : "shutdown_warning", remaining);
+        if (READ_ONCE(shutdown_broadcast))
+            dev_emerg(data->dev, "*** Power failure on %s: system shutdown in %llu seconds ***\n",
+                      data->name, DIV_ROUND_UP_ULL(remaining, MSEC_PER_SEC));
+        else
+            dev_warn(data->dev, "Shutdown in %lld ms.\n", remaining);
+    }
+    if (next) schedule_delayed_work(&data->warn_work, msecs_to_jiffies(remaining - next));
+}
+
+/* ms from now until the latest a policy may put this outage's shutdown */
+static s64 hipi_ups_policy_limit_ms(struct gpio_data *data)
+{
+    s64 limit = (s64)data->shutdown_delay_ms + READ_ONCE(policy_max_extension_ms);
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->lock, flags);
+    if (data->power_state != HIPI_UPS_POWER_MAINS) limit -= hipi_ups_now_ms() - data->on_battery_since;
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    return clamp_t(s64, limit, 0, U32_MAX);
+}
+
+/* ms until the shutdown for an outage that just began, default_ms unless a
+ * policy says otherwise. *held is set if the policy holds off the countdown,
+ * which then runs out at the policy limit.
+ */
+static s64 hipi_ups_policy_countdown_ms(struct gpio_data *data, unsigned int default_ms, bool *held)
+{
+    s32 delay = hipi_ups_policy_on_battery(data, default_ms);
+    s64 limit = hipi_ups_policy_limit_ms(data);
+
+    *held = delay < 0 || delay > limit;
+    return *held ? limit : delay;
+}
+
+/* Start the shutdown countdown, or bring it forward if delay_ms is sooner */
+static void hipi_ups_schedule_shutdown(struct gpio_data *data, unsigned int delay_ms)
+{
+    s64 deadline = hipi_ups_now_ms() + delay_ms;
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->lock, flags);
+    if (data->shutdown_deadline && data->shutdown_deadline <= deadline) {
+        spin_unlock_irqrestore(&data->lock, flags);
+        return;
+    }
+    if (!data->shutdown_deadline) data->warn_sent_ms = U32_MAX; /* A new countdown */
+    data->shutdown_deadline = deadline;
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    mod_delayed_work(system_wq, &data->shutdown_work, msecs_to_jiffies(delay_ms));
+    mod_delayed_work(system_wq, &data->warn_work, 0);
+    hipi_ups_host_warn_update();
+}
+
+static void hipi_ups_cancel_shutdown(struct gpio_data *data)
+{
+    unsigned long flags;
+    bool warned;
+
+    cancel_delayed_work_sync(&data->shutdown_work);
+    cancel_delayed_work_sync(&data->warn_work);
+
+    spin_lock_irqsave(&data->lock, flags);
+    warned = data->warn_sent_ms != U32_MAX;
+    data->warn_sent_ms = U32_MAX;
+    data->shutdown_deadline = 0;
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    /* Let whoever acted on a warning know they can stand down */
+    if (warned) {
+        hipi_ups_warn(data, "shutdown_cancelled", 0);
+        if (READ_ONCE(shutdown_broadcast))
+            dev_emerg(data->dev, "*** Power restored on %s: shutdown cancelled ***\n", data->name);
+    }
+}
+
+void hipi_ups_snapshot(struct gpio_data *data, struct hipi_ups_snapshot *snap)
+{
+    unsigned long flags;
+    s64 now = hipi_ups_now_ms();
+
+    spin_lock_irqsave(&data->lock, flags);
+    snap->name = data->name;
+    snap->power_state = data->power_state;
+    snap->power_fault = data->power_fault;
+    snap->ups_online = data->heartbeat_state == HIPI_UPS_HEARTBEAT_PRESENT;
+    snap->heartbeat_state = data->heartbeat_state;
+    snap->battery_low = data->battery_low;
+    snap->charging = data->charging;
+    snap->shutdown_pending = data->shutdown_deadline != 0;
+    snap->shutdown_remaining_ms = data->shutdown_deadline ? max_t(s64, data->shutdown_deadline - now, 0) : 0;
+    snap->stats = data->stats;
+    snap->on_battery_ms = data->stats.on_battery_ms;
+    if (data->power_state != HIPI_UPS_POWER_MAINS) snap->on_battery_ms += now - data->on_battery_since;
+    spin_unlock_irqrestore(&data->lock, flags);
+}
+
+/* Whether enough sources are off mains for the host to count as on battery,
+ * using the same quorum as the shutdown decision. Caller holds hipi_ups_lock.
+ */
+bool hipi_ups_host_on_battery(void)
+{
+    struct gpio_data *data;
+    unsigned int on_battery = 0, total = 0;
+
+    list_for_each_entry(data, &hipi_ups_instances, node) {
+        total++;
+        if (READ_ONCE(data->power_state) != HIPI_UPS_POWER_MAINS) on_battery++;
+    }
+
+    return hipi_ups_quorum_met(on_battery, total, shutdown_quorum);
+}
+
+/* Poke poll()ers of the state attributes and send a change uevent. Runs from
+ * a work item since state changes also happen in timer (softirq) context.
+ */
+static void notify_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, notify_work);
+    struct power_supply *psy = READ_ONCE(data->psy);
+    char name_env[64];
+    char *envp[] = { name_env, NULL };
+
+    snprintf(name_env, sizeof(name_env), "HIPI_UPS_NAME=%s", data->name);
+
+    sysfs_notify(&data->dev->kobj, NULL, "power_fault");
+    sysfs_notify(&data->dev->kobj, NULL, "power_state");
+    sysfs_notify(&data->dev->kobj, NULL, "ups_online");
+    sysfs_notify(&data->dev->kobj, NULL, "heartbeat_state");
+    sysfs_notify(&data->dev->kobj, NULL, "battery_low");
+    sysfs_notify(&data->dev->kobj, NULL, "charging");
+    if (psy) power_supply_changed(psy);
+    kobject_uevent_env(&data->dev->kobj, KOBJ_CHANGE, envp);
+}
+
+/* Turn the raw heartbeat into heartbeat_state, re-arming itself while a
+ * recovery or a flapping episode is still being timed.
+ */
+static void heartbeat_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, heartbeat_work.work);
+    enum hipi_ups_heartbeat_state old, new;
+    s64 now = hipi_ups_now_ms(), recheck;
+    unsigned int transitions;
+    unsigned long flags;
+    bool on_battery;
+    s32 delay;
+
+    spin_lock_irqsave(&data->lock, flags);
+    old = data->heartbeat_state;
+    new = hipi_ups_heartbeat_next(&data->heartbeat, old, now, data->heartbeat_recover_ms, data->flap_window_ms,
+                                  data->flap_threshold, &transitions, &recheck);
+    data->heartbeat_state = new;
+    on_battery = data->power_state != HIPI_UPS_POWER_MAINS;
+    if (new == HIPI_UPS_HEARTBEAT_FLAPPING && old != new) data->stats.heartbeat_flaps++;
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    if (recheck > 0) schedule_delayed_work(&data->heartbeat_work, msecs_to_jiffies(recheck));
+
+    if (new == old) return;
+
+    switch (new) {
+    case HIPI_UPS_HEARTBEAT_PRESENT:
+        hipi_ups_log(data, HIPI_UPS_LOG_HEARTBEAT, "UPS heartbeat detected (Online).\n");
+        break;
+    case HIPI_UPS_HEARTBEAT_MISSING:
+        hipi_ups_log(data, HIPI_UPS_LOG_HEARTBEAT_LOST, "UPS heartbeat missing! Check hardware connections.\n");
+        if (on_battery) {
+            delay = hipi_ups_policy_heartbeat_lost(data, -1);
+            if (delay >= 0) hipi_ups_schedule_shutdown(data, delay);
+        }
+        break;
+    case HIPI_UPS_HEARTBEAT_FLAPPING:
+        hipi_ups_log(data, HIPI_UPS_LOG_HEARTBEAT_LOST, "UPS heartbeat flapping (%u transitions in %u ms)!\n",
+                     transitions, data->flap_window_ms);
+        break;
+    default:
+        break;
+    }
+    schedule_work(&data->notify_work);
+}
+
+/* ups_online_timer expired due to missing UPS heartbeat */
+static void ups_online_timer_callback(struct timer_list *t)
+{
+    struct gpio_data *data = from_timer(data, t, ups_online_timer);
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->lock, flags);
+    data->stats.watchdog_expiries++;
+    data->stats.heartbeat_loss_time = ktime_get_real_seconds();
+    hipi_ups_heartbeat_set_raw(&data->heartbeat, false, hipi_ups_now_ms());
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    mod_delayed_work(system_wq, &data->heartbeat_work, 0);
+}
+
+/* HIPI_UPS_STATUS_HEARTBEAT: toggle the status line to tell the UPS we're alive */
+static void status_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, status_work.work);
+
+    data->status_level = !data->status_level;
+    gpiod_set_value_cansleep(data->status_desc, data->status_level);
+    schedule_delayed_work(&data->status_work, msecs_to_jiffies(data->status_period_ms));
+}
+
+/* data's countdown has run out: power the host off if that meets the quorum,
+ * or hold. An instance still probing only records it; probe decides once the
+ * instance is counted.
+ */
+static void hipi_ups_host_decide(struct gpio_data *data)
+{
+    unsigned int exhausted, total;
+    unsigned long flags;
+    bool poweroff, warned = false;
+
+    mutex_lock(&hipi_ups_lock);
+    data->exhausted = true;
+    if (!data->listed) {
+        mutex_unlock(&hipi_ups_lock);
+        return;
+    }
+    poweroff = hipi_ups_host_should_poweroff(0, &exhausted, &total);
+    mutex_unlock(&hipi_ups_lock);
+
+    spin_lock_irqsave(&data->lock, flags);
+    if (poweroff) {
+        data->stats.shutdowns_executed++;
+    } else {
+        data->stats.shutdowns_held++;
+        warned = data->warn_sent_ms != U32_MAX;
+        data->warn_sent_ms = U32_MAX;
+    }
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    if (!poweroff) {
+        dev_warn(data->dev, "Power failure persisted for %u ms, but only %u of %u UPS sources are down. Not shutting down.\n",
+                 data->shutdown_delay_ms, exhausted, total);
+        /* Tell whoever got ready for a poweroff that it's not happening yet */
+        hipi_ups_warn(data, "shutdown_held", 0);
+        if (warned && READ_ONCE(shutdown_broadcast))
+            dev_emerg(data->dev, "*** Other UPS sources still have power: shutdown held ***\n");
+        /* Being exhausted brings the others' poweroff closer */
+        hipi_ups_host_warn_update();
+        return;
+    }
+
+    dev_alert(data->dev, "Power failure persisted for %u ms on %u of %u UPS sources. Initiating shutdown.\n",
+              data->shutdown_delay_ms, exhausted, total);
+
+    WRITE_ONCE(hipi_ups_poweroff_started, true);
+    orderly_poweroff(/* force= */ true);
+}
+
+/* delayed_work shutdown_work triggered. Shutdown now */
+static void shutdown_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, shutdown_work.work);
+    unsigned long flags;
+    s32 extend;
+    s64 limit;
+
+    spin_lock_irqsave(&data->lock, flags);
+    data->shutdown_deadline = 0;
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    /* A policy may buy more time, but not once the battery is low */
+    if (!READ_ONCE(data->battery_low)) {
+        extend = hipi_ups_policy_countdown_expired(data, 0);
+        limit = hipi_ups_policy_limit_ms(data);
+        if (extend > limit) {
+            dev_warn(data->dev, "Shutdown policy asked for %d ms more, limited to %lld ms by policy_max_extension_ms.\n",
+                     extend, limit);
+            extend = limit;
+        }
+        if (extend > 0) {
+            dev_info(data->dev, "Shutdown policy extended the countdown by %d ms.\n", extend);
+            hipi_ups_schedule_shutdown(data, extend);
+            return;
+        }
+    }
+
+    hipi_ups_host_decide(data);
+}
+
+/* Last step of a poweroff, after userspace has stopped and devices are shut
+ * down. If it's ours and the power failure has since ended, restart instead so
+ * the host comes back by itself. The lines are sampled afresh, since their
+ * IRQ threads may no longer run, and judged with the same quorum as the
+ * decision to power off.
+ */
+static int hipi_ups_sys_off_prepare(struct sys_off_data *sys_off)
+{
+    unsigned int on_battery = 0, total = 0;
+    struct gpio_data *data;
+
+    if (!READ_ONCE(hipi_ups_poweroff_started) || !READ_ONCE(restart_on_mains_return)) return NOTIFY_DONE;
+
+    mutex_lock(&hipi_ups_lock);
+    list_for_each_entry(data, &hipi_ups_instances, node) {
+        total++;
+        /* A line we can't read counts as still failed */
+        if (gpiod_get_value_cansleep(data->power_desc) != 0) on_battery++;
+    }
+    mutex_unlock(&hipi_ups_lock);
+
+    if (!total || hipi_ups_quorum_met(on_battery, total, shutdown_quorum)) return NOTIFY_DONE;
+
+    pr_alert("hipi-ups: Mains back on %u of %u UPS sources during shutdown. Restarting instead of powering off.\n",
+             total - on_battery, total);
+    emergency_restart();
+    return NOTIFY_DONE;
+}
+
+static irqreturn_t ups_online_irq_handler(int irq, void *dev_id)
+{
+    struct gpio_data *data = dev_id;
+    ktime_t now = ktime_get();
+    unsigned long flags;
+    bool recovered;
+    u64 interval;
+
+    spin_lock_irqsave(&data->lock, flags);
+    /* Intervals spanning a heartbeat loss or a suspend aren't heartbeat intervals */
+    if (IS_ENABLED(CONFIG_HIPI_UPS_STATS)) data->stats.edges[HIPI_UPS_LINE_ONLINE]++;
+    if (IS_ENABLED(CONFIG_HIPI_UPS_STATS) && data->heartbeat.raw && data->last_heartbeat) {
+        interval = ktime_us_delta(now, data->last_heartbeat);
+        if (!data->stats.heartbeat_intervals || interval < data->stats.heartbeat_interval_min_us)
+            data->stats.heartbeat_interval_min_us = interval;
+        if (interval > data->stats.heartbeat_interval_max_us)
+            data->stats.heartbeat_interval_max_us = interval;
+        data->stats.heartbeat_interval_last_us = interval;
+        data->stats.heartbeat_interval_sum_us += interval;
+        data->stats.heartbeat_intervals++;
+    }
+    data->last_heartbeat = now;
+    recovered = !data->heartbeat.raw;
+    hipi_ups_heartbeat_set_raw(&data->heartbeat, true, hipi_ups_now_ms());
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    if (recovered) mod_delayed_work(system_wq, &data->heartbeat_work, 0);
+
+    /* Reset the watchdog timer */
+    mod_timer(&data->ups_online_timer, jiffies + msecs_to_jiffies(data->heartbeat_timeout_ms));
+
+    return IRQ_HANDLED;
+}
+
+/* Estimated ms until the battery is recharged, -1 if unknown */
+s64 hipi_ups_recharge_estimate_ms(struct gpio_data *data)
+{
+    unsigned long flags;
+    s64 remaining = -1;
+
+    spin_lock_irqsave(&data->lock, flags);
+    if (!data->deficit_ms) {
+        remaining = 0;
+    } else if (data->charging && data->charge_per_discharge) {
+        remaining = div_s64(data->deficit_ms * data->charge_per_discharge, 1000) -
+                    (hipi_ups_now_ms() - data->charging_since);
+        remaining = max_t(s64, remaining, 0);
+    }
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    return remaining;
+}
+
+/* Low battery while on battery power: don't wait out the shutdown delay */
+static void hipi_ups_battery_low_changed(struct gpio_data *data, bool low)
+{
+    struct hipi_ups_action act;
+    unsigned long flags;
+    bool power_fault;
+
+    /* Set and check under the lock the power fault handler does the same
+     * under, so whichever of two racing edges comes second sees both.
+     */
+    spin_lock_irqsave(&data->lock, flags);
+    if (low == data->battery_low) {
+        spin_unlock_irqrestore(&data->lock, flags);
+        return;
+    }
+    data->battery_low = low;
+    power_fault = data->power_fault;
+    spin_unlock_irqrestore(&data->lock, flags);
+    schedule_work(&data->notify_work);
+
+    act = hipi_ups_battery_low_action(low, power_fault);
+    hipi_ups_log_action(data, HIPI_UPS_LOG_BATTERY, &act);
+    if (act.todo & HIPI_UPS_DO_SHUTDOWN_NOW) hipi_ups_schedule_shutdown(data, 0);
+}
+
+/* Learn how long a charge takes per unit of time spent on battery */
+static void hipi_ups_charging_changed(struct gpio_data *data, bool charging)
+{
+    unsigned long flags;
+    s64 now = hipi_ups_now_ms(), charged;
+
+    if (charging == data->charging) return;
+
+    spin_lock_irqsave(&data->lock, flags);
+    data->charging = charging;
+    if (charging) {
+        data->charging_since = now;
+    } else {
+        charged = now - data->charging_since;
+        if (data->power_fault && data->charge_per_discharge) {
+            /* Charge interrupted by an outage: only part of the deficit was made up */
+            data->deficit_ms -= div_s64(charged * 1000, data->charge_per_discharge);
+            data->deficit_ms = max_t(s64, data->deficit_ms, 0);
+        } else if (!data->power_fault) {
+            /* Charger finished */
+            if (data->deficit_ms)
+                data->charge_per_discharge = div_s64(charged * 1000, data->deficit_ms);
+            data->deficit_ms = 0;
+        }
+    }
+    spin_unlock_irqrestore(&data->lock, flags);
+
+    hipi_ups_log(data, HIPI_UPS_LOG_BATTERY, "Battery %s.\n", charging ? "charging" : "not charging");
+    schedule_work(&data->notify_work);
+}
+
+static irqreturn_t battery_low_irq_handler(int irq, void *dev_id)
+{
+    struct gpio_data *data = dev_id;
+
+    hipi_ups_count_edge(data, HIPI_UPS_LINE_BATTERY_LOW);
+    hipi_ups_battery_low_changed(data, gpiod_get_value_cansleep(data->battery_low_desc) == 1);
+    return IRQ_HANDLED;
+}
+
+static irqreturn_t charging_irq_handler(int irq, void *dev_id)
+{
+    struct gpio_data *data = dev_id;
+
+    hipi_ups_count_edge(data, HIPI_UPS_LINE_CHARGING);
+    hipi_ups_charging_changed(data, gpiod_get_value_cansleep(data->charging_desc) == 1);
+    return IRQ_HANDLED;
+}
+
+/* Poll the optional lines whose GPIO controller can't give us an IRQ */
+static void sample_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, sample_work.work);
+    bool val;
+
+    if (data->battery_low_desc && data->battery_low_irq < 0) {
+        val = gpiod_get_value_cansleep(data->battery_low_desc) == 1;
+        if (val != data->battery_low) hipi_ups_count_edge(data, HIPI_UPS_LINE_BATTERY_LOW);
+        hipi_ups_battery_low_changed(data, val);
+    }
+    if (data->charging_desc && data->charging_irq < 0) {
+        val = gpiod_get_value_cansleep(data->charging_desc) == 1;
+        if (val != data->charging) hipi_ups_count_edge(data, HIPI_UPS_LINE_CHARGING);
+        hipi_ups_charging_changed(data, val);
+    }
+
+    schedule_delayed_work(&data->sample_work, msecs_to_jiffies(SAMPLE_INTERVAL_MS));
+}
+
+static void hipi_ups_missed_edge(struct gpio_data *data, enum hipi_ups_line line, const char *what)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->lock, flags);
+    data->stats.missed_edges[line]++;
+    spin_unlock_irqrestore(&data->lock, flags);
+    dev_warn(data->dev, "Missed an edge on the %s line, catching up.\n", what);
+}
+
+/* Outage accounting. Caller holds data->lock. */
+static void hipi_ups_outage_begin(struct gpio_data *data, s64 now)
+{
+    data->on_battery_since = now;
+    data->stats.outages++;
+    data->stats.outage_start_time = ktime_get_real_seconds();
+}
+
+static void hipi_ups_outage_end(struct gpio_data *data, s64 now)
+{
+    s64 duration = now - data->on_battery_since;
+
+    data->deficit_ms += duration;
+    data->stats.on_battery_ms += duration;
+    data->stats.outage_last_ms = duration;
+    data->stats.outage_longest_ms = max_t(u64, data->stats.outage_longest_ms, duration);
+    data->stats.outage_end_time = ktime_get_real_seconds();
+    if (data->shutdown_deadline) data->stats.shutdowns_cancelled++;
+}
+
+/* Mains has been back for restore_stable_ms: end the outage */
+static void restore_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, restore_work.work);
+    struct hipi_ups_action act;
+    unsigned long flags;
+
+    spin_lock_irqsave(&data->lock, flags);
+    act = hipi_ups_restore_action(data->power_state);
+    if (!(act.todo & HIPI_UPS_DO_RESTORED)) {
+        spin_unlock_irqrestore(&data->lock, flags);
+        return;
+    }
+    data->power_state = HIPI_UPS_POWER_MAINS;
+    hipi_ups_outage_end(data, hipi_ups_now_ms());
+    spin_unlock_irqrestore(&data->lock, flags);
+    hipi_ups_cpu_update();
+
+    hipi_ups_log_action(data, HIPI_UPS_LOG_POWER, &act);
+    hipi_ups_cancel_shutdown(data);
+    hipi_ups_policy_restored(data);
+
+    mutex_lock(&hipi_ups_lock);
+    data->exhausted = false;
+    mutex_unlock(&hipi_ups_lock);
+
+    schedule_work(&data->notify_work);
+}
+
+/* Hard IRQ half: only timestamp the edge, the thread does the work */
+static irqreturn_t power_irq_hardirq(int irq, void *dev_id)
+{
+    struct gpio_data *data = dev_id;
+
+    data->power_irq_time = ktime_get();
+    return IRQ_WAKE_THREAD;
+}
+
+/* Account the wait between the hard IRQ and its thread. IRQF_ONESHOT keeps
+ * the line masked until the thread is done, so power_irq_time is stable.
+ */
+static void hipi_ups_power_latency(struct gpio_data *data)
+{
+    unsigned int slo = READ_ONCE(power_latency_slo_us), i;
+    unsigned long flags;
+    bool missed;
+    u64 latency;
+
+    if (!data->power_irq_time) return; /* Called outside the IRQ, e.g. from reconcile */
+    latency = ktime_us_delta(ktime_get(), data->power_irq_time);
+    data->power_irq_time = 0;
+    missed = slo && latency > slo;
+
+    for (i = 0; i < HIPI_UPS_LATENCY_BUCKETS - 1; i++)
+        if (latency <= hipi_ups_latency_bounds_us[i]) break;
+
+    if (IS_ENABLED(CONFIG_HIPI_UPS_STATS)) {
+        spin_lock_irqsave(&data->lock, flags);
+        data->stats.power_latency[i]++;
+        data->stats.power_latency_sum_us += latency;
+        data->stats.power_latency_max_us = max(data->stats.power_latency_max_us, latency);
+        if (missed) data->stats.power_latency_slo_misses++;
+        spin_unlock_irqrestore(&data->lock, flags);
+    }
+
+    trace_hipi_ups_power_latency(data->name, latency, missed);
+    if (missed)
+        hipi_ups_log(data, HIPI_UPS_LOG_LATENCY, "Power fault handled %llu us after the edge (SLO %u us).\n",
+                     latency, slo);
+}
+
+static irqreturn_t power_irq_handler(int irq, void *dev_id)
+{
+    struct gpio_data *data = dev_id;
+    int val = gpiod_get_value_cansleep(data->power_desc);
+    enum hipi_ups_power_state old;
+    struct hipi_ups_action act;
+    unsigned long flags;
+    bool battery_low, held;
+
+    hipi_ups_power_latency(data);
+    hipi_ups_count_edge(data, HIPI_UPS_LINE_POWER);
+
+    /* Keep the state we have; reconcile tries again */
+    if (val < 0) {
+        dev_warn_ratelimited(data->dev, "Can't read the power fault line (%d)\n", val);
+        return IRQ_HANDLED;
+    }
+
+    /* See hipi_ups_battery_low_changed() */
+    spin_lock_irqsave(&data->lock, flags);
+    if (val == data->power_fault) {
+        spin_unlock_irqrestore(&data->lock, flags);
+        return IRQ_HANDLED;
+    }
+    data->power_fault = val;
+    battery_low = data->battery_low;
+    old = data->power_state;
+    data->power_state = hipi_ups_power_next(old, val == 1);
+    if (val == 1) {
+        if (old == HIPI_UPS_POWER_MAINS) hipi_ups_outage_begin(data, hipi_ups_now_ms());
+        else if (old == HIPI_UPS_POWER_RESTORING) data->stats.restores_unstable++;
+    }
+    spin_unlock_irqrestore(&data->lock, flags);
+    schedule_work(&data->notify_work);
+    /* Keep a system woken by this edge up long enough to start the countdown */
+    if (val == 1) pm_wakeup_event(data->dev, 0);
+    if (old == HIPI_UPS_POWER_MAINS) hipi_ups_cpu_update();
+
+    act = hipi_ups_power_action(old, val == 1, battery_low, data->shutdown_delay_ms, data->restore_stable_ms);
+    if (act.todo & HIPI_UPS_DO_RESTORE_STOP) cancel_delayed_work(&data->restore_work);
+    if (act.todo & HIPI_UPS_DO_COUNTDOWN) {
+        act.ms = hipi_ups_policy_countdown_ms(data, act.ms, &held);
+        if (held) {
+            hipi_ups_log(data, HIPI_UPS_LOG_POWER, "Power Lost! Shutdown policy holds off the countdown for up to %u ms.\n",
+                         act.ms);
+            hipi_ups_schedule_shutdown(data, act.ms);
+            return IRQ_HANDLED;
+        }
+    }
+
+    hipi_ups_log_action(data, HIPI_UPS_LOG_POWER, &act);
+    if (act.todo & HIPI_UPS_DO_SHUTDOWN_NOW) hipi_ups_schedule_shutdown(data, 0);
+    if (act.todo & HIPI_UPS_DO_COUNTDOWN) hipi_ups_schedule_shutdown(data, act.ms);
+    if (act.todo & HIPI_UPS_DO_RESTORE_START)
+        schedule_delayed_work(&data->restore_work, msecs_to_jiffies(act.ms));
+
+    return IRQ_HANDLED;
+}
+
+/* Check each line that has an IRQ against the state built from its edges,
+ * and replay the edge if one was lost. The IRQ is disabled meanwhile so the
+ * replay can't race its handler. Sampled lines are kept right by sample_work
+ * and the heartbeat by its watchdog.
+ */
+static void hipi_ups_reconcile(struct gpio_data *data)
+{
+    int power;
+    bool val;
+
+    disable_irq(data->power_irq);
+    power = gpiod_get_value_cansleep(data->power_desc);
+    if (power >= 0 && power != data->power_fault) {
+        hipi_ups_missed_edge(data, HIPI_UPS_LINE_POWER, "power fault");
+        power_irq_handler(data->power_irq, data);
+    }
+    enable_irq(data->power_irq);
+
+    if (data->battery_low_desc && data->battery_low_irq >= 0) {
+        disable_irq(data->battery_low_irq);
+        val = gpiod_get_value_cansleep(data->battery_low_desc) == 1;
+        if (val != data->battery_low) {
+            hipi_ups_missed_edge(data, HIPI_UPS_LINE_BATTERY_LOW, "battery low");
+            hipi_ups_battery_low_changed(data, val);
+        }
+        enable_irq(data->battery_low_irq);
+    }
+    if (data->charging_desc && data->charging_irq >= 0) {
+        disable_irq(data->charging_irq);
+        val = gpiod_get_value_cansleep(data->charging_desc) == 1;
+        if (val != data->charging) {
+            hipi_ups_missed_edge(data, HIPI_UPS_LINE_CHARGING, "charging");
+            hipi_ups_charging_changed(data, val);
+        }
+        enable_irq(data->charging_irq);
+    }
+}
+
+static void reconcile_work_handler(struct work_struct *work)
+{
+    struct gpio_data *data = container_of(work, struct gpio_data, reconcile_work.work);
+
+    hipi_ups_reconcile(data);
+    queue_delayed_work(system_freezable_wq, &data->reconcile_work, msecs_to_jiffies(reconcile_interval_ms));
+}
+
+/* devm action: give the instance index back */
+static void hipi_ups_free_id(void *arg)
+{
+    ida_free(&hipi_ups_ida, (int)(uintptr_t)arg);
+}
+
+/* devm action: leave the host-wide instance list */
+static void hipi_ups_host_remove(void *arg)
+{
+    struct gpio_data *data = arg;
+
+    mutex_lock(&hipi_ups_lock);
+    list_del(&data->node);
+    data->listed = false;
+    mutex_unlock(&hipi_ups_lock);
+
+    hipi_ups_cpu_update();
+}
+
+/* Request an optional input line, with an IRQ if the controller has one.
+ * Lines without an IRQ are left for sample_work; *irq is negative for those.
+ */
+static int hipi_ups_get_optional_line(struct gpio_data *data, const char *con_id,
+                                      struct gpio_desc **desc, int *irq,
+                                      irq_handler_t handler)
+{
+    struct device *dev = data->dev;
+    const char *irq_name;
+    int ret;
+
+    *irq = -ENXIO;
+    *desc = devm_gpiod_get_optional(dev, con_id, GPIOD_IN);
+    if (IS_ERR(*desc))
+        return dev_err_probe(dev, PTR_ERR(*desc), "Failed to get %s-gpios\n", con_id);
+    if (!*desc) return 0;
+
+    *irq = gpiod_to_irq(*desc);
+    if (*irq == -EPROBE_DEFER) return *irq;
+    if (*irq < 0) {
+        dev_info(dev, "No IRQ for %s-gpios, sampling every %d ms\n", con_id, SAMPLE_INTERVAL_MS);
+        return 0;
+    }
+
+    irq_name = devm_kasprintf(dev, GFP_KERNEL, "%s-%s", data->name, con_id);
+    if (!irq_name) return -ENOMEM;
+    ret = devm_request_threaded_irq(dev, *irq, NULL, handler,
+                                    IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+                                    irq_name, data);
+    if (ret) return dev_err_probe(dev, ret, "Failed to request %s IRQ\n", con_id);
+
+    return 0;
+}
+
+/* devm action: stop being a wakeup source */
+static void hipi_ups_disable_wakeup(void *arg)
+{
+    device_init_wakeup(arg, false);
+}
+
+/* devm action: stop the heartbeat watchdog */
+static void hipi_ups_del_timer(void *arg)
+{
+    struct gpio_data *data = arg;
+
+    del_timer_sync(&data->ups_online_timer);
+}
+
+static int hipi_ups_probe(struct platform_device *pdev)
+{
+    struct device *dev = &pdev->dev;
+    irq_handler_t hardirq = NULL;
+    struct gpio_data *data;
+    const char *irq_name;
+    bool held;
+    s64 delay;
+    int ret, i;
+
+    data = devm_kzalloc(dev, sizeof(*data), GFP_KERNEL);
+    if (!data) return -ENOMEM;
+
+    data->dev = dev;
+    spin_lock_init(&data->lock);
+    data->warn_sent_ms = U32_MAX;
+    for (i = 0; i < HIPI_UPS_LOG_COUNT; i++) {
+        ratelimit_state_init(&data->log_rs[i], msecs_to_jiffies(log_ratelimit_ms), log_ratelimit_burst);
+        /* We print our own summary of what was suppressed */
+        ratelimit_set_flags(&data->log_rs[i], RATELIMIT_MSG_ON_RELEASE);
+    }
+
+    /* Non-DT instances pick a board by device name, else get the HiPi defaults */
+    data->board = device_get_match_data(dev);
+    if (!data->board && platform_get_device_id(pdev))
+        data->board = (const struct hipi_ups_board *)platform_get_device_id(pdev)->driver_data;
+    if (!data->board) data->board = &hipi_ups_board_hipi;
+    data->shutdown_delay_ms = data->board->shutdown_delay_ms;
+    data->heartbeat_timeout_ms = data->board->heartbeat_timeout_ms;
+    data->status_period_ms = data->board->status_period_ms;
+    data->restore_stable_ms = data->board->restore_stable_ms;
+    data->heartbeat_recover_ms = data->board->heartbeat_recover_ms;
+    data->flap_window_ms = HEARTBEAT_FLAP_WINDOW_MS;
+    data->flap_threshold = HEARTBEAT_FLAP_THRESHOLD;
+
+    /* Per-site tuning from DT (see the overlay's __overrides__). Properties
+     * that are absent leave the board defaults untouched.
+     */
+    device_property_read_u32(dev, "shutdown-delay-ms", &data->shutdown_delay_ms);
+    device_property_read_u32(dev, "heartbeat-timeout-ms", &data->heartbeat_timeout_ms);
+    device_property_read_u32(dev, "status-period-ms", &data->status_period_ms);
+    device_property_read_u32(dev, "restore-stable-ms", &data->restore_stable_ms);
+    device_property_read_u32(dev, "heartbeat-recover-ms", &data->heartbeat_recover_ms);
+    device_property_read_u32(dev, "heartbeat-flap-window-ms", &data->flap_window_ms);
+    device_property_read_u32(dev, "heartbeat-flap-threshold", &data->flap_threshold);
+    data->flap_threshold = clamp_t(unsigned int, data->flap_threshold, 2, HIPI_UPS_FLAP_MAX_TRANSITIONS);
+    if (data->board->status_protocol == HIPI_UPS_STATUS_HEARTBEAT && !data->status_period_ms)
+        return dev_err_probe(dev, -EINVAL, "status-period-ms must not be 0\n");
+
+    /* --- Instance identity --- */
+    /* Several custom,hipi-ups nodes may be present (redundant supplies, test
+     * rigs), so everything user visible is named per instance.
+     */
+    data->id = ida_alloc(&hipi_ups_ida, GFP_KERNEL);
+    if (data->id < 0) return data->id;
+    ret = devm_add_action_or_reset(dev, hipi_ups_free_id, (void *)(uintptr_t)data->id);
+    if (ret) return ret;
+
+    if (device_property_read_string(dev, "label", &data->name))
+        data->name = devm_kasprintf(dev, GFP_KERNEL, "hipi-ups%d", data->id);
+    if (!data->name) return -ENOMEM;
+
+    ret = devm_work_autocancel(dev, &data->notify_work, notify_work_handler);
+    if (ret) return ret;
+
+    /* --- Pi status/heartbeat output --- */
+    /* Request the pin and immediately initialize it to Logical 0 (Low).
+     * GPIOD_OUT_LOW assumes Active High logic.
+     */
+    if (data->board->optional_lines & HIPI_UPS_STATUS_OPTIONAL)
+        data->status_desc = devm_gpiod_get_optional(dev, "status", GPIOD_OUT_LOW);
+    else
+        data->status_desc = devm_gpiod_get(dev, "status", GPIOD_OUT_LOW);
+    if (IS_ERR(data->status_desc))
+        return dev_err_probe(dev, PTR_ERR(data->status_desc), "Failed to get status-gpios\n");
+
+    if (data->status_desc) {
+        if (data->board->status_active_low) gpiod_toggle_active_low(data->status_desc);
+
+        /* Explicitly set value to 0 to be extra clear */
+        gpiod_set_value_cansleep(data->status_desc, 0);
+
+        ret = devm_delayed_work_autocancel(dev, &data->status_work, status_work_handler);
+        if (ret) return ret;
+        if (data->board->status_protocol == HIPI_UPS_STATUS_HEARTBEAT)
+            schedule_delayed_work(&data->status_work, msecs_to_jiffies(data->status_period_ms));
+    }
+
+    /* --- Power fault detection --- */
+    /* Initialize the delayed work structure. Registered before the IRQ so
+     * that devm tears it down only after the IRQ that schedules it is freed,
+     * which also covers a probe that fails or defers part way through.
+     */
+    ret = devm_delayed_work_autocancel(dev, &data->shutdown_work, shutdown_work_handler);
+    if (ret) return ret;
+    ret = devm_delayed_work_autocancel(dev, &data->warn_work, warn_work_handler);
+    if (ret) return ret;
+    ret = devm_delayed_work_autocancel(dev, &data->restore_work, restore_work_handler);
+    if (ret) return ret;
+
+    /* Get the Power GPIO (corresponds to "power-gpios" in Device Tree) */
+    data->power_desc = devm_gpiod_get(dev, "power", GPIOD_IN);
+    if (IS_ERR(data->power_desc))
+        return dev_err_probe(dev, PTR_ERR(data->power_desc), "Failed to get power-gpios\n");
+    if (data->board->power_active_low) gpiod_toggle_active_low(data->power_desc);
+
+    /* Check initial state in case we booted without power */
+    ret = gpiod_get_value_cansleep(data->power_desc);
+    if (ret < 0) return dev_err_probe(dev, ret, "Failed to read power-gpios\n");
+    data->power_fault = ret;
+    if (data->power_fault) {
+        dev_warn(dev, "Booted with power failure detected.\n");
+        data->power_state = HIPI_UPS_POWER_BATTERY;
+        hipi_ups_outage_begin(data, hipi_ups_now_ms());
+        /* An outage like any other as far as a policy is concerned */
+        delay = hipi_ups_policy_countdown_ms(data, data->shutdown_delay_ms, &held);
+        if (held) dev_warn(dev, "Shutdown policy holds off the countdown for up to %lld ms.\n", delay);
+        hipi_ups_schedule_shutdown(data, delay);
+    }
+
+    /* Map the GPIO to an IRQ number */
+    data->power_irq = gpiod_to_irq(data->power_desc);
+    if (data->power_irq < 0)
+        return dev_err_probe(dev, data->power_irq, "Failed to map power-gpios to IRQ\n");
+
+    /* Request the interrupt */
+    /* IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING for both edges */
+    irq_name = devm_kasprintf(dev, GFP_KERNEL, "%s-power", data->name);
+    if (!irq_name) return -ENOMEM;
+    /* The hard IRQ half only exists to timestamp edges for latency accounting */
+    if (IS_ENABLED(CONFIG_HIPI_UPS_STATS) || IS_ENABLED(CONFIG_HIPI_UPS_TRACEPOINTS))
+        hardirq = power_irq_hardirq;
+    ret = devm_request_threaded_irq(dev, data->power_irq, hardirq, power_irq_handler,
+                                    IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+                                    irq_name, data);
+    if (ret) return dev_err_probe(dev, ret, "Failed to request power fault IRQ\n");
+
+    /* A power loss while suspended must wake us to start the countdown */
+    device_init_wakeup(dev, true);
+    ret = devm_add_action_or_reset(dev, hipi_ups_disable_wakeup, dev);
+    if (ret) return ret;
+
+    /* --- Battery low / charging (optional) --- */
+    /* Sampled lines are polled by sample_work; as with shutdown_work it is
+     * registered before the IRQs that can touch the same state.
+     */
+    ret = devm_delayed_work_autocancel(dev, &data->sample_work, sample_work_handler);
+    if (ret) return ret;
+
+    ret = hipi_ups_get_optional_line(data, "battery-low", &data->battery_low_desc,
+                                     &data->battery_low_irq, battery_low_irq_handler);
+    if (ret) return ret;
+
+    ret = hipi_ups_get_optional_line(data, "charging", &data->charging_desc,
+                                     &data->charging_irq, charging_irq_handler);
+    if (ret) return ret;
+
+    if (data->battery_low_desc)
+        hipi_ups_battery_low_changed(data, gpiod_get_value_cansleep(data->battery_low_desc) == 1);
+    if (data->charging_desc)
+        hipi_ups_charging_changed(data, gpiod_get_value_cansleep(data->charging_desc) == 1);
+    if ((data->battery_low_desc && data->battery_low_irq < 0) ||
+        (data->charging_desc && data->charging_irq < 0))
+        schedule_delayed_work(&data->sample_work, msecs_to_jiffies(SAMPLE_INTERVAL_MS));
+
+    /* --- UPS online detection --- */
+    /* Same ordering rule as shutdown_work: the timer is deleted by devm after
+     * the online IRQ that re-arms it has been freed.
+     */
+    ret = devm_delayed_work_autocancel(dev, &data->heartbeat_work, heartbeat_work_handler);
+    if (ret) return ret;
+
+    timer_setup(&data->ups_online_timer, ups_online_timer_callback, 0);
+    ret = devm_add_action_or_reset(dev, hipi_ups_del_timer, data);
+    if (ret) return ret;
+
+    if (data->board->optional_lines & HIPI_UPS_ONLINE_OPTIONAL)
+        data->ups_online_desc = devm_gpiod_get_optional(dev, "online", GPIOD_IN);
+    else
+        data->ups_online_desc = devm_gpiod_get(dev, "online", GPIOD_IN);
+    if (IS_ERR(data->ups_online_desc))
+        return dev_err_probe(dev, PTR_ERR(data->ups_online_desc), "Failed to get online-gpios\n");
+
+    if (!data->ups_online_desc || !data->heartbeat_timeout_ms) {
+        /* No heartbeat line, or watching it is disabled: assume the UPS is there */
+        data->heartbeat_state = HIPI_UPS_HEARTBEAT_PRESENT;
+        goto done;
+    }
+
+    data->ups_online_irq = gpiod_to_irq(data->ups_online_desc);
+    if (data->ups_online_irq < 0)
+        return dev_err_probe(dev, data->ups_online_irq, "Failed to map online-gpios to IRQ\n");
+
+    irq_name = devm_kasprintf(dev, GFP_KERNEL, "%s-online", data->name);
+    if (!irq_name) return -ENOMEM;
+    ret = devm_request_threaded_irq(dev, data->ups_online_irq, NULL, ups_online_irq_handler,
+                                    IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING | IRQF_ONESHOT,
+                                    irq_name, data);
+    if (ret) return dev_err_probe(dev, ret, "Failed to request UPS online IRQ\n");
+
+    /* Start the watchdog timer to wait for first toggle */
+    mod_timer(&data->ups_online_timer, jiffies + msecs_to_jiffies(data->heartbeat_timeout_ms));
+
+done:
+    /* Edges between the initial reads above and the IRQ requests were lost;
+     * catch up on them now, then keep checking. Unlike the other work, this
+     * is registered after the IRQs, since devm must cancel it before it can
+     * touch a freed IRQ.
+     */
+    ret = devm_delayed_work_autocancel(dev, &data->reconcile_work, reconcile_work_handler);
+    if (ret) return ret;
+    hipi_ups_reconcile(data);
+    if (reconcile_interval_ms)
+        queue_delayed_work(system_freezable_wq, &data->reconcile_work, msecs_to_jiffies(reconcile_interval_ms));
+
+    platform_set_drvdata(pdev, data);
+
+    /* Only now that every line is held can the host-level decisions (quorum,
+     * the check at poweroff, offlined CPUs) count this instance; a probe that
+     * fails or defers earlier is never seen by them.
+     */
+    mutex_lock(&hipi_ups_lock);
+    list_add_tail(&data->node, &hipi_ups_instances);
+    data->listed = true;
+    /* A countdown that ran out while probing (e.g. booted on battery with the
+     * battery already low) is decided again now that it counts. Through
+     * shutdown_work, so that mains coming back still cancels it; once that
+     * has set MAINS, it's too late to ask.
+     */
+    if (data->exhausted && READ_ONCE(data->power_state) != HIPI_UPS_POWER_MAINS)
+        mod_delayed_work(system_wq, &data->shutdown_work, 0);
+    mutex_unlock(&hipi_ups_lock);
+    ret = devm_add_action_or_reset(dev, hipi_ups_host_remove, data);
+    if (ret) return ret;
+    hipi_ups_cpu_update();
+    hipi_ups_host_warn_update();
+
+    /* Only a view of the state above: not worth leaving the UPS unwatched
+     * for, e.g. when the name is already taken by another supply
+     */
+    ret = hipi_ups_power_supply_register(data);
+    if (ret) dev_warn(dev, "Can't register a power supply (%d), continuing without one\n", ret);
+
+    dev_info(dev, "Driver probed as %s (%s board), monitoring IRQ %d\n",
+             data->name, data->board->name, data->power_irq);
+    return 0;
+}
+
+static void hipi_ups_remove(struct platform_device *pdev)
+{
+    struct gpio_data *data = platform_get_drvdata(pdev);
+
+    /* The ups_online_timer and any pending shutdown_work are torn down by
+     * devm once the IRQs that re-arm them have been freed (see probe).
+     */
+
+    /* When module unloads, we could let devm_ handle releasing the status pin
+     * or release it manually. Choosing the former but also explicitly setting
+     * it High in the meantime to make sure the UPS receives the signal. Stop
+     * any status heartbeat first so it can't drive the line low again.
+     */
+    if (data->status_desc) {
+        cancel_delayed_work_sync(&data->status_work);
+        dev_info(&pdev->dev, "Setting status pin to HIGH (Stopping).\n");
+        gpiod_set_value_cansleep(data->status_desc, 1);
+    }
+
+    dev_info(&pdev->dev, "Module unloaded.\n");
+}
+
+/* --- Power management --- */
+
+/* Suspending would sleep through a running shutdown countdown (and the
+ * battery), so refuse while one is pending. Otherwise pause the heartbeat
+ * watchdog, whose jiffies-based timer would otherwise expire spuriously on
+ * resume, and arm the power fault line as a wakeup source.
+ */
+static int hipi_ups_suspend(struct device *dev)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+    unsigned long flags;
+    bool pending;
+
+    spin_lock_irqsave(&data->lock, flags);
+    pending = data->shutdown_deadline != 0;
+    spin_unlock_irqrestore(&data->lock, flags);
+    if (pending) {
+        dev_warn(dev, "Shutdown pending, refusing to suspend.\n");
+        return -EBUSY;
+    }
+
+    if (data->ups_online_irq > 0) {
+        disable_irq(data->ups_online_irq);
+        del_timer_sync(&data->ups_online_timer);
+    }
+
+    if (device_may_wakeup(dev)) enable_irq_wake(data->power_irq);
+    return 0;
+}
+
+static int hipi_ups_resume(struct device *dev)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+    unsigned long flags;
+    s64 deadline;
+
+    if (device_may_wakeup(dev)) disable_irq_wake(data->power_irq);
+
+    /* Catch a power edge we slept through, e.g. without wakeup enabled. The
+     * IRQ is live again, so go through reconcile rather than racing its
+     * thread for a wake edge.
+     */
+    hipi_ups_reconcile(data);
+
+    /* shutdown_work runs on jiffies, which stood still while suspended; re-arm
+     * it from the boottime deadline.
+     */
+    spin_lock_irqsave(&data->lock, flags);
+    deadline = data->shutdown_deadline;
+    spin_unlock_irqrestore(&data->lock, flags);
+    if (deadline) {
+        mod_delayed_work(system_wq, &data->shutdown_work,
+                         msecs_to_jiffies(max_t(s64, deadline - hipi_ups_now_ms(), 0)));
+        mod_delayed_work(system_wq, &data->warn_work, 0);
+    }
+
+    /* Give the heartbeat a full timeout to show up again */
+    if (data->ups_online_irq > 0) {
+        spin_lock_irqsave(&data->lock, flags);
+        data->last_heartbeat = 0;
+        spin_unlock_irqrestore(&data->lock, flags);
+        mod_timer(&data->ups_online_timer, jiffies + msecs_to_jiffies(data->heartbeat_timeout_ms));
+        enable_irq(data->ups_online_irq);
+    }
+
+    return 0;
+}
+
+static DEFINE_SIMPLE_DEV_PM_OPS(hipi_ups_pm_ops, hipi_ups_suspend, hipi_ups_resume);
+
+/* --- sysfs --- */
+
+static ssize_t label_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%s\n", data->name);
+}
+static DEVICE_ATTR_RO(label);
+
+static ssize_t power_fault_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", data->power_fault);
+}
+static DEVICE_ATTR_RO(power_fault);
+
+static const char * const hipi_ups_power_state_names[] = {
+    [HIPI_UPS_POWER_MAINS] = "mains",
+    [HIPI_UPS_POWER_BATTERY] = "battery",
+    [HIPI_UPS_POWER_RESTORING] = "restoring",
+};
+
+static ssize_t power_state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%s\n", hipi_ups_power_state_names[READ_ONCE(data->power_state)]);
+}
+static DEVICE_ATTR_RO(power_state);
+
+static ssize_t ups_online_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", READ_ONCE(data->heartbeat_state) == HIPI_UPS_HEARTBEAT_PRESENT);
+}
+static DEVICE_ATTR_RO(ups_online);
+
+static const char * const hipi_ups_heartbeat_state_names[] = {
+    [HIPI_UPS_HEARTBEAT_UNKNOWN] = "unknown",
+    [HIPI_UPS_HEARTBEAT_PRESENT] = "present",
+    [HIPI_UPS_HEARTBEAT_MISSING] = "missing",
+    [HIPI_UPS_HEARTBEAT_FLAPPING] = "flapping",
+};
+
+static ssize_t heartbeat_state_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%s\n", hipi_ups_heartbeat_state_names[READ_ONCE(data->heartbeat_state)]);
+}
+static DEVICE_ATTR_RO(heartbeat_state);
+
+static ssize_t battery_low_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", data->battery_low);
+}
+static DEVICE_ATTR_RO(battery_low);
+
+static ssize_t charging_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%d\n", data->charging);
+}
+static DEVICE_ATTR_RO(charging);
+
+static ssize_t recharge_estimate_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+
+    return sysfs_emit(buf, "%lld\n", hipi_ups_recharge_estimate_ms(data));
+}
+static DEVICE_ATTR_RO(recharge_estimate_ms);
+
+static ssize_t shutdown_remaining_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct hipi_ups_snapshot snap;
+
+    hipi_ups_snapshot(dev_get_drvdata(dev), &snap);
+    if (!snap.shutdown_pending) return sysfs_emit(buf, "-1\n");
+    return sysfs_emit(buf, "%llu\n", snap.shutdown_remaining_ms);
+}
+static DEVICE_ATTR_RO(shutdown_remaining_ms);
+
+/* Like shutdown_remaining_ms, but -1 unless the countdown running out would
+ * really power the host off, i.e. shutdown_quorum would be met by then
+ */
+static ssize_t poweroff_remaining_ms_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct gpio_data *data = dev_get_drvdata(dev);
+    unsigned int down, total;
+    unsigned long flags;
+    bool poweroff;
+    s64 deadline;
+
+    spin_lock_irqsave(&data->lock, flags);
+    deadline = data->shutdown_deadline;
+    spin_unlock_irqrestore(&data->lock, flags);
+    if (!deadline) return sysfs_emit(buf, "-1\n");
+
+    mutex_lock(&hipi_ups_lock);
+    poweroff = hipi_ups_host_should_poweroff(deadline, &down, &total);
+    mutex_unlock(&hipi_ups_lock);
+    if (!poweroff) return sysfs_emit(buf, "-1\n");
+    return sysfs_emit(buf, "%lld\n", max_t(s64, deadline - hipi_ups_now_ms(), 0));
+}
+static DEVICE_ATTR_RO(poweroff_remaining_ms);
+
+/* stats/: outage accounting for capacity planning */
+#define HIPI_UPS_STAT_ATTR(_name, _field)                                                   \
+static ssize_t _name##_show(struct device *dev, struct device_attribute *attr, char *buf)  \
+{                                                                                           \
+    struct hipi_ups_snapshot snap;                                                          \
+                                                                                            \
+    hipi_ups_snapshot(dev_get_drvdata(dev), &snap);                                         \
+    return sysfs_emit(buf, "%llu\n", snap._field);                                          \
+}                                                                                           \
+static DEVICE_ATTR_RO(_name)
+
+HIPI_UPS_STAT_ATTR(outages, stats.outages);
+HIPI_UPS_STAT_ATTR(on_battery_total_ms, on_battery_ms);
+HIPI_UPS_STAT_ATTR(outage_last_ms, stats.outage_last_ms);
+HIPI_UPS_STAT_ATTR(outage_longest_ms, stats.outage_longest_ms);
+HIPI_UPS_STAT_ATTR(outage_start_time, stats.outage_start_time);
+HIPI_UPS_STAT_ATTR(outage_end_time, stats.outage_end_time);
+HIPI_UPS_STAT_ATTR(shutdowns_cancelled, stats.shutdowns_cancelled);
+HIPI_UPS_STAT_ATTR(shutdowns_executed, stats.shutdowns_executed);
+HIPI_UPS_STAT_ATTR(shutdowns_held, stats.shutdowns_held);
+HIPI_UPS_STAT_ATTR(restores_unstable, stats.restores_unstable);
+HIPI_UPS_STAT_ATTR(heartbeat_losses, stats.watchdog_expiries);
+HIPI_UPS_STAT_ATTR(heartbeat_loss_time, stats.heartbeat_loss_time);
+HIPI_UPS_STAT_ATTR(heartbeat_flaps, stats.heartbeat_flaps);
+
+static ssize_t missed_edges_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct hipi_ups_snapshot snap;
+    u64 total = 0;
+    int line;
+
+    hipi_ups_snapshot(dev_get_drvdata(dev), &snap);
+    for (line = 0; line < HIPI_UPS_LINE_COUNT; line++) total += snap.stats.missed_edges[line];
+    return sysfs_emit(buf, "%llu\n", total);
+}
+static DEVICE_ATTR_RO(missed_edges);
+
+static struct attribute *hipi_ups_stats_attrs[] = {
+    &dev_attr_outages.attr,
+    &dev_attr_on_battery_total_ms.attr,
+    &dev_attr_outage_last_ms.attr,
+    &dev_attr_outage_longest_ms.attr,
+    &dev_attr_outage_start_time.attr,
+    &dev_attr_outage_end_time.attr,
+    &dev_attr_shutdowns_cancelled.attr,
+    &dev_attr_shutdowns_executed.attr,
+    &dev_attr_shutdowns_held.attr,
+    &dev_attr_restores_unstable.attr,
+    &dev_attr_heartbeat_losses.attr,
+    &dev_attr_heartbeat_loss_time.attr,
+    &dev_attr_heartbeat_flaps.attr,
+    &dev_attr_missed_edges.attr,
+    NULL
+};
+
+static const struct attribute_group hipi_ups_stats_group = {
+    .name = "stats",
+    .attrs = hipi_ups_stats_attrs,
+};
+
+static struct attribute *hipi_ups_attrs[] = {
+    &dev_attr_label.attr,
+    &dev_attr_power_fault.attr,
+    &dev_attr_power_state.attr,
+    &dev_attr_ups_online.attr,
+    &dev_attr_heartbeat_state.attr,
+    &dev_attr_battery_low.attr,
+    &dev_attr_charging.attr,
+    &dev_attr_recharge_estimate_ms.attr,
+    &dev_attr_shutdown_remaining_ms.attr,
+    &dev_attr_poweroff_remaining_ms.attr,
+    NULL
+};
+
+static const struct attribute_group hipi_ups_group = {
+    .attrs = hipi_ups_attrs,
+};
+
+static const struct attribute_group *hipi_ups_groups[] = {
+    &hipi_ups_group,
+    &hipi_ups_stats_group,
+    NULL
+};
+
+static struct platform_driver hipi_ups_driver = {
+    .probe = hipi_ups_probe,
+    .remove = hipi_ups_remove,
+    .driver = {
+        .name = "hipi_ups",
+        .of_match_table = hipi_ups_of_match,
+        .dev_groups = hipi_ups_groups,
+        .pm = pm_ptr(&hipi_ups_pm_ops),
+        /* Nothing else waits on us; don't hold up boot while the GPIO
+         * controller and IRQs are set up.
+         */
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
+    },
+    .id_table = hipi_ups_id_table,
+};
+
+static int __init hipi_ups_init(void)
+{
+    int ret;
+
+    ret = hipi_ups_debugfs_init();
+    if (ret) return ret;
+
+    /* The policy hook is optional and must never cost us power fail
+     * protection, e.g. in a module built without BTF
+     */
+    ret = hipi_ups_bpf_init();
+    if (ret) pr_warn("hipi-ups: Can't register the shutdown policy hook (%d), continuing without policies\n", ret);
+
+    hipi_ups_sys_off = register_sys_off_handler(SYS_OFF_MODE_POWER_OFF_PREPARE, SYS_OFF_PRIO_DEFAULT,
+                                                hipi_ups_sys_off_prepare, NULL);
+    if (IS_ERR(hipi_ups_sys_off)) {
+        ret = PTR_ERR(hipi_ups_sys_off);
+        goto err_debugfs;
+    }
+
+    ret = platform_driver_register(&hipi_ups_driver);
+    if (ret) goto err_sys_off;
+
+    ret = hipi_ups_configfs_init();
+    if (ret) goto err_driver;
+    return 0;
+
+err_driver:
+    platform_driver_unregister(&hipi_ups_driver);
+err_sys_off:
+    unregister_sys_off_handler(hipi_ups_sys_off);
+err_debugfs:
+    hipi_ups_debugfs_exit();
+    return ret;
+}
+
+static void __exit hipi_ups_exit(void)
+{
+    hipi_ups_configfs_exit();
+    platform_driver_unregister(&hipi_ups_driver);
+    unregister_sys_off_handler(hipi_ups_sys_off);
+    hipi_ups_cpu_exit();
+    hipi_ups_debugfs_exit();
+}
+
+/* When built in, register ahead of the regular device_initcall()s so the power
+ * lines are watched as early as possible. early_initcall() would be too early:
+ * it runs before the driver core is initialised. Modules map this to
+ * module_init().
+ */
+subsys_initcall(hipi_ups_init);
+module_exit(hipi_ups_exit);
@@ -0,0 +1,162 @@
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/ktime.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/printk.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+#include "hipi-ups.h"
+
+static struct cpumask hipi_ups_cpus_down; /* CPUs we took offline; only touched by the work */
+static struct cpumask hipi_ups_cpus_wanted; /* Parsed battery_offline_cpus */
+/* Scratch for a new value. Static, since a built-in driver's parameters are
+ * set before the slab allocator is up.
+ */
+static struct cpumask hipi_ups_cpus_parsed;
+static DEFINE_MUTEX(hipi_ups_cpus_wanted_lock); /* Protects the two above */
+
+/* Parse the whole list before taking it, so a bad write leaves the old one */
+static int battery_offline_cpus_set(const char *val, const struct kernel_param *kp)
+{
+    int ret;
+
+    mutex_lock(&hipi_ups_cpus_wanted_lock);
+    ret = cpulist_parse(val, &hipi_ups_cpus_parsed);
+    if (!ret) cpumask_copy(&hipi_ups_cpus_wanted, &hipi_ups_cpus_parsed);
+    mutex_unlock(&hipi_ups_cpus_wanted_lock);
+    return ret;
+}
+
+static int battery_offline_cpus_get(char *buffer, const struct kernel_param *kp)
+{
+    int ret;
+
+    mutex_lock(&hipi_ups_cpus_wanted_lock);
+    ret = sprintf(buffer, "%*pbl\n", cpumask_pr_args(&hipi_ups_cpus_wanted));
+    mutex_unlock(&hipi_ups_cpus_wanted_lock);
+    return ret;
+}
+
+static const struct kernel_param_ops battery_offline_cpus_ops = {
+    .set = battery_offline_cpus_set,
+    .get = battery_offline_cpus_get,
+};
+
+/* CPUs to take offline while the host runs on battery, as a cpulist
+ * ("1-3"). Empty leaves every CPU alone. Tasks pinned to these CPUs lose
+ * their affinity while they're down, so leave out any CPU a critical
+ * service is pinned to.
+ */
+module_param_cb(battery_offline_cpus, &battery_offline_cpus_ops, NULL, 0644);
+MODULE_PARM_DESC(battery_offline_cpus,
+                 "CPUs (cpulist) to take offline while on battery; CPU 0 is never taken offline");
+
+static struct hipi_ups_cpu_stats hipi_ups_cpu_stats;
+static DEFINE_SPINLOCK(hipi_ups_cpu_stats_lock);
+
+static void hipi_ups_cpu_record(u64 *count, u64 *last_us, u64 *max_us, s64 elapsed_us)
+{
+    spin_lock(&hipi_ups_cpu_stats_lock);
+    (*count)++;
+    *last_us = elapsed_us;
+    *max_us = max_t(u64, *max_us, elapsed_us);
+    hipi_ups_cpu_stats.cpus_down = cpumask_weight(&hipi_ups_cpus_down);
+    spin_unlock(&hipi_ups_cpu_stats_lock);
+}
+
+static void hipi_ups_cpus_offline(void)
+{
+    cpumask_var_t want;
+    unsigned int cpu;
+    ktime_t start;
+    s64 elapsed;
+    int ret;
+
+    if (!zalloc_cpumask_var(&want, GFP_KERNEL)) return;
+    mutex_lock(&hipi_ups_cpus_wanted_lock);
+    cpumask_copy(want, &hipi_ups_cpus_wanted);
+    mutex_unlock(&hipi_ups_cpus_wanted_lock);
+
+    for_each_cpu(cpu, want) {
+        /* CPU 0 keeps timekeeping and most IRQs, including ours */
+        if (!cpu || !cpu_online(cpu) || !cpu_is_hotpluggable(cpu)) continue;
+
+        start = ktime_get();
+        ret = remove_cpu(cpu);
+        elapsed = ktime_us_delta(ktime_get(), start);
+        if (ret) {
+            pr_warn("hipi-ups: Failed to take CPU %u offline: %d\n", cpu, ret);
+            continue;
+        }
+        cpumask_set_cpu(cpu, &hipi_ups_cpus_down);
+        hipi_ups_cpu_record(&hipi_ups_cpu_stats.offlines, &hipi_ups_cpu_stats.offline_last_us,
+                            &hipi_ups_cpu_stats.offline_max_us, elapsed);
+        pr_info("hipi-ups: On battery, CPU %u offline (%lld us).\n", cpu, elapsed);
+    }
+    free_cpumask_var(want);
+}
+
+/* Only bring back the CPUs we took down; ones the admin offlined stay off */
+static void hipi_ups_cpus_online(void)
+{
+    unsigned int cpu;
+    ktime_t start;
+    s64 elapsed;
+    int ret;
+
+    for_each_cpu(cpu, &hipi_ups_cpus_down) {
+        start = ktime_get();
+        ret = add_cpu(cpu);
+        elapsed = ktime_us_delta(ktime_get(), start);
+        if (ret) {
+            pr_warn("hipi-ups: Failed to bring CPU %u back online: %d\n", cpu, ret);
+            continue;
+        }
+        cpumask_clear_cpu(cpu, &hipi_ups_cpus_down);
+        hipi_ups_cpu_record(&hipi_ups_cpu_stats.onlines, &hipi_ups_cpu_stats.online_last_us,
+                            &hipi_ups_cpu_stats.online_max_us, elapsed);
+        pr_info("hipi-ups: Power back, CPU %u online (%lld us).\n", cpu, elapsed);
+    }
+}
+
+/* Hotplug takes tens of ms per CPU and sleeps, so it runs from a work item.
+ * A work item never runs concurrently with itself, which serialises access
+ * to hipi_ups_cpus_down.
+ */
+static void hipi_ups_cpu_work_handler(struct work_struct *work)
+{
+    bool on_battery;
+
+    mutex_lock(&hipi_ups_lock);
+    on_battery = hipi_ups_host_on_battery();
+    mutex_unlock(&hipi_ups_lock);
+
+    if (on_battery)
+        hipi_ups_cpus_offline();
+    else
+        hipi_ups_cpus_online();
+}
+static DECLARE_WORK(hipi_ups_cpu_work, hipi_ups_cpu_work_handler);
+
+/* Re-evaluate after a change in any instance's power state */
+void hipi_ups_cpu_update(void)
+{
+    schedule_work(&hipi_ups_cpu_work);
+}
+
+void hipi_ups_cpu_stats_get(struct hipi_ups_cpu_stats *stats)
+{
+    spin_lock(&hipi_ups_cpu_stats_lock);
+    *stats = hipi_ups_cpu_stats;
+    spin_unlock(&hipi_ups_cpu_stats_lock);
+}
+
+/* Module unload: every instance is gone, so hand back all our CPUs */
+void hipi_ups_cpu_exit(void)
+{
+    cancel_work_sync(&hipi_ups_cpu_work);
+    hipi_ups_cpus_online();
+}
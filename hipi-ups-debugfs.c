@@ -0,0 +1,278 @@
+#include <linux/debugfs.h>
+#include <linux/math64.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/stddef.h>
+
+#include "hipi-ups.h"
+
+static struct dentry *hipi_ups_debugfs_root;
+
+enum hipi_ups_metric_unit {
+    HIPI_UPS_UNIT_NONE,
+    HIPI_UPS_UNIT_MS, /* Stored in ms, reported in seconds */
+    HIPI_UPS_UNIT_US, /* Stored in us, reported in seconds */
+};
+
+/* One Prometheus metric backed by a u64 in struct hipi_ups_snapshot */
+struct hipi_ups_metric {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+    enum hipi_ups_metric_unit unit;
+    bool stats; /* Only counted with CONFIG_HIPI_UPS_STATS */
+};
+
+#define HIPI_UPS_METRIC(_name, _type, _field, _unit, _help) \
+    { "hipi_ups_" _name, _type, _help, offsetof(struct hipi_ups_snapshot, _field), _unit }
+#define HIPI_UPS_STATS_METRIC(_name, _type, _field, _unit, _help) \
+    { "hipi_ups_" _name, _type, _help, offsetof(struct hipi_ups_snapshot, _field), _unit, true }
+
+static const struct hipi_ups_metric hipi_ups_metrics[] = {
+    HIPI_UPS_METRIC("power_state", "gauge", power_state, HIPI_UPS_UNIT_NONE,
+                    "0 = on mains, 1 = on battery, 2 = mains back but not yet stable."),
+    HIPI_UPS_METRIC("power_fault", "gauge", power_fault, HIPI_UPS_UNIT_NONE,
+                    "1 while the power fault line is active."),
+    HIPI_UPS_METRIC("online", "gauge", ups_online, HIPI_UPS_UNIT_NONE,
+                    "1 while the UPS heartbeat is steadily present."),
+    HIPI_UPS_METRIC("heartbeat_state", "gauge", heartbeat_state, HIPI_UPS_UNIT_NONE,
+                    "0 = unknown, 1 = present, 2 = missing, 3 = flapping."),
+    HIPI_UPS_METRIC("battery_low", "gauge", battery_low, HIPI_UPS_UNIT_NONE,
+                    "1 while the battery-low line is active."),
+    HIPI_UPS_METRIC("charging", "gauge", charging, HIPI_UPS_UNIT_NONE,
+                    "1 while the charging line is active."),
+    HIPI_UPS_METRIC("shutdown_pending", "gauge", shutdown_pending, HIPI_UPS_UNIT_NONE,
+                    "1 while the shutdown countdown is running."),
+    HIPI_UPS_METRIC("shutdown_countdown_seconds", "gauge", shutdown_remaining_ms, HIPI_UPS_UNIT_MS,
+                    "Time left before the shutdown countdown expires."),
+    HIPI_UPS_STATS_METRIC("heartbeat_interval_min_seconds", "gauge", stats.heartbeat_interval_min_us, HIPI_UPS_UNIT_US,
+                    "Shortest interval between UPS heartbeat edges."),
+    HIPI_UPS_STATS_METRIC("heartbeat_interval_max_seconds", "gauge", stats.heartbeat_interval_max_us, HIPI_UPS_UNIT_US,
+                    "Longest interval between UPS heartbeat edges."),
+    HIPI_UPS_STATS_METRIC("heartbeat_interval_last_seconds", "gauge", stats.heartbeat_interval_last_us, HIPI_UPS_UNIT_US,
+                    "Most recent interval between UPS heartbeat edges."),
+    HIPI_UPS_METRIC("heartbeat_watchdog_expiries_total", "counter", stats.watchdog_expiries, HIPI_UPS_UNIT_NONE,
+                    "Times the UPS heartbeat went missing."),
+    HIPI_UPS_METRIC("heartbeat_flaps_total", "counter", stats.heartbeat_flaps, HIPI_UPS_UNIT_NONE,
+                    "Times the UPS heartbeat was reported flapping."),
+    HIPI_UPS_STATS_METRIC("power_latency_max_seconds", "gauge", stats.power_latency_max_us, HIPI_UPS_UNIT_US,
+                    "Longest wait from a power fault edge to its handler."),
+    HIPI_UPS_STATS_METRIC("power_latency_slo_misses_total", "counter", stats.power_latency_slo_misses, HIPI_UPS_UNIT_NONE,
+                    "Power fault edges handled later than power_latency_slo_us."),
+    HIPI_UPS_METRIC("outages_total", "counter", stats.outages, HIPI_UPS_UNIT_NONE,
+                    "Power faults seen."),
+    HIPI_UPS_METRIC("on_battery_seconds_total", "counter", on_battery_ms, HIPI_UPS_UNIT_MS,
+                    "Time spent on battery power, including the current outage."),
+    HIPI_UPS_METRIC("outage_last_seconds", "gauge", stats.outage_last_ms, HIPI_UPS_UNIT_MS,
+                    "Duration of the last completed outage."),
+    HIPI_UPS_METRIC("outage_longest_seconds", "gauge", stats.outage_longest_ms, HIPI_UPS_UNIT_MS,
+                    "Duration of the longest completed outage."),
+    HIPI_UPS_METRIC("outage_start_time_seconds", "gauge", stats.outage_start_time, HIPI_UPS_UNIT_NONE,
+                    "Unix time the last outage started."),
+    HIPI_UPS_METRIC("outage_end_time_seconds", "gauge", stats.outage_end_time, HIPI_UPS_UNIT_NONE,
+                    "Unix time the last outage ended."),
+    HIPI_UPS_METRIC("shutdowns_cancelled_total", "counter", stats.shutdowns_cancelled, HIPI_UPS_UNIT_NONE,
+                    "Shutdown countdowns stopped by power returning."),
+    HIPI_UPS_METRIC("shutdowns_executed_total", "counter", stats.shutdowns_executed, HIPI_UPS_UNIT_NONE,
+                    "Shutdown countdowns that powered the host off."),
+    HIPI_UPS_METRIC("shutdowns_held_total", "counter", stats.shutdowns_held, HIPI_UPS_UNIT_NONE,
+                    "Shutdown countdowns that expired while other UPS sources still had power."),
+    HIPI_UPS_METRIC("restores_unstable_total", "counter", stats.restores_unstable, HIPI_UPS_UNIT_NONE,
+                    "Times mains came back but dropped again before it was stable."),
+};
+
+static const char * const hipi_ups_line_names[HIPI_UPS_LINE_COUNT] = {
+    [HIPI_UPS_LINE_POWER] = "power",
+    [HIPI_UPS_LINE_ONLINE] = "online",
+    [HIPI_UPS_LINE_BATTERY_LOW] = "battery_low",
+    [HIPI_UPS_LINE_CHARGING] = "charging",
+};
+
+static void hipi_ups_metric_value(struct seq_file *s, u64 val, enum hipi_ups_metric_unit unit)
+{
+    u32 rem;
+
+    switch (unit) {
+    case HIPI_UPS_UNIT_MS:
+        val = div_u64_rem(val, MSEC_PER_SEC, &rem);
+        seq_printf(s, "%llu.%03u\n", val, rem);
+        break;
+    case HIPI_UPS_UNIT_US:
+        val = div_u64_rem(val, USEC_PER_SEC, &rem);
+        seq_printf(s, "%llu.%06u\n", val, rem);
+        break;
+    default:
+        seq_printf(s, "%llu\n", val);
+        break;
+    }
+}
+
+/* Start a sample with its ups label. Labels may be configfs directory names,
+ * so escape them as the text format requires.
+ */
+static void hipi_ups_metric_start(struct seq_file *s, const char *metric, const char *ups)
+{
+    seq_printf(s, "%s{ups=\"", metric);
+    for (; *ups; ups++) {
+        switch (*ups) {
+        case '\\': seq_puts(s, "\\\\"); break;
+        case '"': seq_puts(s, "\\\""); break;
+        case '\n': seq_puts(s, "\\n"); break;
+        default: seq_putc(s, *ups); break;
+        }
+    }
+    seq_putc(s, '"');
+}
+
+/* Families only counted with CONFIG_HIPI_UPS_STATS. Without it they'd read as
+ * real zeros, so they're left out altogether.
+ */
+static void hipi_ups_metrics_stats_show(struct seq_file *s, const struct hipi_ups_snapshot *snaps,
+                                        unsigned int count)
+{
+    unsigned int i, j, line;
+
+    seq_puts(s, "# HELP hipi_ups_line_edges_total Edges seen on each input line.\n"
+                "# TYPE hipi_ups_line_edges_total counter\n");
+    for (i = 0; i < count; i++)
+        for (line = 0; line < HIPI_UPS_LINE_COUNT; line++) {
+            hipi_ups_metric_start(s, "hipi_ups_line_edges_total", snaps[i].name);
+            seq_printf(s, ",line=\"%s\"} %llu\n", hipi_ups_line_names[line], snaps[i].stats.edges[line]);
+        }
+
+    seq_puts(s, "# HELP hipi_ups_heartbeat_interval_seconds Interval between UPS heartbeat edges.\n"
+                "# TYPE hipi_ups_heartbeat_interval_seconds summary\n");
+    for (i = 0; i < count; i++) {
+        hipi_ups_metric_start(s, "hipi_ups_heartbeat_interval_seconds_sum", snaps[i].name);
+        seq_puts(s, "} ");
+        hipi_ups_metric_value(s, snaps[i].stats.heartbeat_interval_sum_us, HIPI_UPS_UNIT_US);
+        hipi_ups_metric_start(s, "hipi_ups_heartbeat_interval_seconds_count", snaps[i].name);
+        seq_printf(s, "} %llu\n", snaps[i].stats.heartbeat_intervals);
+    }
+
+    seq_puts(s, "# HELP hipi_ups_power_latency_seconds Time from a power fault edge to its handler running.\n"
+                "# TYPE hipi_ups_power_latency_seconds histogram\n");
+    for (i = 0; i < count; i++) {
+        u64 cumulative = 0;
+
+        for (j = 0; j < HIPI_UPS_LATENCY_BUCKETS; j++) {
+            cumulative += snaps[i].stats.power_latency[j];
+            hipi_ups_metric_start(s, "hipi_ups_power_latency_seconds_bucket", snaps[i].name);
+            seq_puts(s, ",le=\"");
+            if (j < HIPI_UPS_LATENCY_BUCKETS - 1) {
+                seq_printf(s, "%u.%06u\"} %llu\n", hipi_ups_latency_bounds_us[j] / (u32)USEC_PER_SEC,
+                           hipi_ups_latency_bounds_us[j] % (u32)USEC_PER_SEC, cumulative);
+            } else {
+                seq_printf(s, "+Inf\"} %llu\n", cumulative);
+            }
+        }
+        hipi_ups_metric_start(s, "hipi_ups_power_latency_seconds_sum", snaps[i].name);
+        seq_puts(s, "} ");
+        hipi_ups_metric_value(s, snaps[i].stats.power_latency_sum_us, HIPI_UPS_UNIT_US);
+        hipi_ups_metric_start(s, "hipi_ups_power_latency_seconds_count", snaps[i].name);
+        seq_printf(s, "} %llu\n", cumulative);
+    }
+}
+
+/* Families only kept with CONFIG_HIPI_UPS_CPU_HOTPLUG, left out without it
+ * for the same reason as the stats ones
+ */
+static void hipi_ups_metrics_cpu_show(struct seq_file *s)
+{
+    struct hipi_ups_cpu_stats cpu;
+
+    hipi_ups_cpu_stats_get(&cpu);
+    seq_printf(s, "# HELP hipi_ups_cpus_offline CPUs currently taken offline while on battery.\n"
+                  "# TYPE hipi_ups_cpus_offline gauge\n"
+                  "hipi_ups_cpus_offline %llu\n", cpu.cpus_down);
+    seq_printf(s, "# HELP hipi_ups_cpu_hotplug_total CPU hotplug operations done while on or off battery.\n"
+                  "# TYPE hipi_ups_cpu_hotplug_total counter\n"
+                  "hipi_ups_cpu_hotplug_total{op=\"offline\"} %llu\n"
+                  "hipi_ups_cpu_hotplug_total{op=\"online\"} %llu\n", cpu.offlines, cpu.onlines);
+    seq_puts(s, "# HELP hipi_ups_cpu_hotplug_last_seconds Duration of the last CPU hotplug operation.\n"
+                "# TYPE hipi_ups_cpu_hotplug_last_seconds gauge\n");
+    seq_puts(s, "hipi_ups_cpu_hotplug_last_seconds{op=\"offline\"} ");
+    hipi_ups_metric_value(s, cpu.offline_last_us, HIPI_UPS_UNIT_US);
+    seq_puts(s, "hipi_ups_cpu_hotplug_last_seconds{op=\"online\"} ");
+    hipi_ups_metric_value(s, cpu.online_last_us, HIPI_UPS_UNIT_US);
+    seq_puts(s, "# HELP hipi_ups_cpu_hotplug_max_seconds Longest CPU hotplug operation.\n"
+                "# TYPE hipi_ups_cpu_hotplug_max_seconds gauge\n");
+    seq_puts(s, "hipi_ups_cpu_hotplug_max_seconds{op=\"offline\"} ");
+    hipi_ups_metric_value(s, cpu.offline_max_us, HIPI_UPS_UNIT_US);
+    seq_puts(s, "hipi_ups_cpu_hotplug_max_seconds{op=\"online\"} ");
+    hipi_ups_metric_value(s, cpu.online_max_us, HIPI_UPS_UNIT_US);
+}
+
+/* All instances' counters in Prometheus text format, for node_exporter's
+ * textfile collector. Snapshots are taken up front so that every metric
+ * family reports the same moment.
+ */
+static int metrics_show(struct seq_file *s, void *unused)
+{
+    struct hipi_ups_snapshot *snaps;
+    struct gpio_data *data;
+    unsigned int count = 0, i, j, line;
+    const struct hipi_ups_metric *m;
+
+    mutex_lock(&hipi_ups_lock);
+    list_for_each_entry(data, &hipi_ups_instances, node)
+        count++;
+    snaps = kcalloc(count, sizeof(*snaps), GFP_KERNEL);
+    if (!snaps) {
+        mutex_unlock(&hipi_ups_lock);
+        return -ENOMEM;
+    }
+    i = 0;
+    list_for_each_entry(data, &hipi_ups_instances, node)
+        hipi_ups_snapshot(data, &snaps[i++]);
+
+    for (j = 0; j < ARRAY_SIZE(hipi_ups_metrics); j++) {
+        m = &hipi_ups_metrics[j];
+        if (m->stats && !IS_ENABLED(CONFIG_HIPI_UPS_STATS)) continue;
+        seq_printf(s, "# HELP %s %s\n# TYPE %s %s\n", m->name, m->help, m->name, m->type);
+        for (i = 0; i < count; i++) {
+            hipi_ups_metric_start(s, m->name, snaps[i].name);
+            seq_puts(s, "} ");
+            hipi_ups_metric_value(s, *(u64 *)((char *)&snaps[i] + m->offset), m->unit);
+        }
+    }
+
+    seq_puts(s, "# HELP hipi_ups_line_missed_edges_total Edges found missing by comparing line levels with the state.\n"
+                "# TYPE hipi_ups_line_missed_edges_total counter\n");
+    for (i = 0; i < count; i++)
+        for (line = 0; line < HIPI_UPS_LINE_COUNT; line++) {
+            hipi_ups_metric_start(s, "hipi_ups_line_missed_edges_total", snaps[i].name);
+            seq_printf(s, ",line=\"%s\"} %llu\n", hipi_ups_line_names[line], snaps[i].stats.missed_edges[line]);
+        }
+
+    seq_puts(s, "# HELP hipi_ups_log_suppressed_total Console messages dropped by the ratelimit, per class.\n"
+                "# TYPE hipi_ups_log_suppressed_total counter\n");
+    for (i = 0; i < count; i++)
+        for (j = 0; j < HIPI_UPS_LOG_COUNT; j++) {
+            hipi_ups_metric_start(s, "hipi_ups_log_suppressed_total", snaps[i].name);
+            seq_printf(s, ",class=\"%s\"} %llu\n", hipi_ups_log_class_names[j], snaps[i].stats.log_suppressed[j]);
+        }
+
+    if (IS_ENABLED(CONFIG_HIPI_UPS_STATS)) hipi_ups_metrics_stats_show(s, snaps, count);
+
+    /* Names point into the instances, so only drop the lock once printed */
+    mutex_unlock(&hipi_ups_lock);
+    kfree(snaps);
+
+    if (IS_ENABLED(CONFIG_HIPI_UPS_CPU_HOTPLUG)) hipi_ups_metrics_cpu_show(s);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(metrics);
+
+int hipi_ups_debugfs_init(void)
+{
+    hipi_ups_debugfs_root = debugfs_create_dir("hipi-ups", NULL);
+    debugfs_create_file("metrics", 0444, hipi_ups_debugfs_root, NULL, &metrics_fops);
+    return 0;
+}
+
+void hipi_ups_debugfs_exit(void)
+{
+    debugfs_remove_recursive(hipi_ups_debugfs_root);
+}
@@ -0,0 +1,187 @@
+#ifndef HIPI_UPS_LOGIC_H
+#define HIPI_UPS_LOGIC_H
+
+/* The driver's decisions as pure functions of line history and settings, with
+ * no locking or I/O, so tools/hipi-ups-gpiod can follow exactly the same rules
+ * from userspace. Each returns what to do, and the caller does it with its own
+ * timers and log. Times are ms on a monotonic clock.
+ */
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#else
+#include <stdbool.h>
+#include <stdint.h>
+typedef int64_t s64;
+#endif
+
+/* Host power as seen through one UPS. An outage lasts from entering
+ * HIPI_UPS_POWER_BATTERY until leaving HIPI_UPS_POWER_RESTORING for MAINS.
+ */
+enum hipi_ups_power_state {
+    HIPI_UPS_POWER_MAINS,
+    HIPI_UPS_POWER_BATTERY,   /* Power fault: on battery, shutdown countdown running */
+    HIPI_UPS_POWER_RESTORING, /* Mains back but not yet stable; countdown still running */
+};
+
+/* UPS heartbeat as reported to userspace. The raw heartbeat (edges seen
+ * within heartbeat_timeout_ms) is debounced: recovery must hold for
+ * heartbeat_recover_ms, and too many raw transitions within the flap window
+ * report FLAPPING until the heartbeat has been quiet for a whole window.
+ */
+enum hipi_ups_heartbeat_state {
+    HIPI_UPS_HEARTBEAT_UNKNOWN, /* Not yet seen, watchdog not yet expired */
+    HIPI_UPS_HEARTBEAT_PRESENT,
+    HIPI_UPS_HEARTBEAT_MISSING,
+    HIPI_UPS_HEARTBEAT_FLAPPING,
+};
+
+#define HIPI_UPS_FLAP_MAX_TRANSITIONS 16
+
+/* Raw heartbeat history behind hipi_ups_heartbeat_state */
+struct hipi_ups_heartbeat {
+    bool raw;  /* Heartbeat edges seen within heartbeat_timeout_ms */
+    s64 since; /* When raw last became true */
+    s64 transitions[HIPI_UPS_FLAP_MAX_TRANSITIONS]; /* Ring of raw transition times */
+    unsigned int next;
+};
+
+/* Power state after the power fault line was read as fault. A fault is
+ * always BATTERY; mains coming back only ends an outage once it has been
+ * stable for restore_stable_ms (RESTORING to MAINS is the caller's timer).
+ */
+static inline enum hipi_ups_power_state hipi_ups_power_next(enum hipi_ups_power_state old, bool fault)
+{
+    if (fault) return HIPI_UPS_POWER_BATTERY;
+    return old == HIPI_UPS_POWER_BATTERY ? HIPI_UPS_POWER_RESTORING : old;
+}
+
+/* What the caller must do about a line change or timer, as decided below */
+#define HIPI_UPS_DO_COUNTDOWN     (1U << 0) /* Start the shutdown countdown, in ms */
+#define HIPI_UPS_DO_SHUTDOWN_NOW  (1U << 1) /* Bring the shutdown forward to now */
+#define HIPI_UPS_DO_RESTORE_START (1U << 2) /* Start the restore_stable_ms timer */
+#define HIPI_UPS_DO_RESTORE_STOP  (1U << 3) /* Stop the restore timer */
+#define HIPI_UPS_DO_RESTORED      (1U << 4) /* Go to MAINS, end the outage, cancel the countdown */
+
+struct hipi_ups_action {
+    unsigned int todo; /* HIPI_UPS_DO_* */
+    const char *msg;   /* Format for the log, taking ms; NULL for nothing */
+    bool alert;        /* msg calls for an alert rather than a notice */
+    unsigned int ms;   /* Countdown or restore timer length, and msg's argument */
+};
+
+/* Action for the power fault line changing from its last value (so fault is
+ * the new value), taken after hipi_ups_power_next() moved on from old.
+ * A countdown is shutdown_delay_ms, which the caller may change (a policy)
+ * before logging msg.
+ */
+static inline struct hipi_ups_action hipi_ups_power_action(enum hipi_ups_power_state old, bool fault,
+                                                          bool battery_low, unsigned int shutdown_delay_ms,
+                                                          unsigned int restore_stable_ms)
+{
+    struct hipi_ups_action act = { 0 };
+
+    if (fault && old == HIPI_UPS_POWER_RESTORING) {
+        /* Unstable mains: keep the countdown we already have running */
+        act.todo = HIPI_UPS_DO_RESTORE_STOP | (battery_low ? HIPI_UPS_DO_SHUTDOWN_NOW : 0);
+        act.msg = "Power Lost again before it was stable. Shutdown still scheduled.\n";
+    } else if (fault && battery_low) {
+        act.todo = HIPI_UPS_DO_SHUTDOWN_NOW;
+        act.msg = "Power Lost with battery low! Shutting down now.\n";
+        act.alert = true;
+    } else if (fault) {
+        act.todo = HIPI_UPS_DO_COUNTDOWN;
+        act.msg = "Power Lost! Shutdown scheduled in %u ms.\n";
+        act.ms = shutdown_delay_ms;
+    } else if (old == HIPI_UPS_POWER_BATTERY) {
+        /* Cancel the shutdown once mains has been stable for
+         * restore_stable_ms, so flapping mains can't keep postponing it.
+         */
+        act.todo = HIPI_UPS_DO_RESTORE_START;
+        if (restore_stable_ms) act.msg = "Power back. Cancelling shutdown if stable for %u ms.\n";
+        act.ms = restore_stable_ms;
+    }
+    return act;
+}
+
+/* Action for the restore timer running out while in state */
+static inline struct hipi_ups_action hipi_ups_restore_action(enum hipi_ups_power_state state)
+{
+    struct hipi_ups_action act = { 0 };
+
+    /* Otherwise it lost the race with a new power fault */
+    if (state == HIPI_UPS_POWER_RESTORING) {
+        act.todo = HIPI_UPS_DO_RESTORED;
+        act.msg = "Power Restored. Shutdown cancelled.\n";
+    }
+    return act;
+}
+
+/* Action for the battery-low line changing to low */
+static inline struct hipi_ups_action hipi_ups_battery_low_action(bool low, bool power_fault)
+{
+    struct hipi_ups_action act = { 0 };
+
+    if (!low) {
+        act.msg = "Battery no longer low.\n";
+    } else if (power_fault) {
+        act.todo = HIPI_UPS_DO_SHUTDOWN_NOW;
+        act.msg = "Battery low while on battery power! Shutting down now.\n";
+        act.alert = true;
+    } else {
+        act.msg = "Battery low.\n";
+    }
+    return act;
+}
+
+/* Whether down of total UPS sources meet the shutdown quorum (0 = all) */
+static inline bool hipi_ups_quorum_met(unsigned int down, unsigned int total, unsigned int quorum)
+{
+    unsigned int needed = quorum && quorum < total ? quorum : total;
+
+    return down && down >= needed;
+}
+
+/* Record the raw heartbeat being seen or lost at now */
+static inline void hipi_ups_heartbeat_set_raw(struct hipi_ups_heartbeat *hb, bool raw, s64 now)
+{
+    if (raw == hb->raw) return;
+    hb->raw = raw;
+    if (raw) hb->since = now;
+    hb->transitions[hb->next] = now;
+    hb->next = (hb->next + 1) % HIPI_UPS_FLAP_MAX_TRANSITIONS;
+}
+
+/* Debounce the raw heartbeat into the state to report. *transitions gets the
+ * raw transitions within the flap window, and *recheck the ms after which to
+ * call again while a recovery or a flapping episode is being timed (0 if
+ * nothing is).
+ */
+static inline enum hipi_ups_heartbeat_state
+hipi_ups_heartbeat_next(const struct hipi_ups_heartbeat *hb, enum hipi_ups_heartbeat_state old, s64 now,
+                        unsigned int recover_ms, unsigned int flap_window_ms, unsigned int flap_threshold,
+                        unsigned int *transitions, s64 *recheck)
+{
+    s64 last = hb->transitions[(hb->next + HIPI_UPS_FLAP_MAX_TRANSITIONS - 1) % HIPI_UPS_FLAP_MAX_TRANSITIONS];
+    unsigned int i;
+
+    *transitions = 0;
+    *recheck = 0;
+    for (i = 0; i < HIPI_UPS_FLAP_MAX_TRANSITIONS; i++)
+        if (hb->transitions[i] && now - hb->transitions[i] < flap_window_ms) (*transitions)++;
+
+    if (*transitions >= flap_threshold ||
+        (old == HIPI_UPS_HEARTBEAT_FLAPPING && now - last < flap_window_ms)) {
+        /* Stay flapping until a whole window passes without transitions */
+        *recheck = last + flap_window_ms - now;
+        return HIPI_UPS_HEARTBEAT_FLAPPING;
+    }
+    if (!hb->raw) return HIPI_UPS_HEARTBEAT_MISSING;
+    if (now - hb->since >= recover_ms) return HIPI_UPS_HEARTBEAT_PRESENT;
+
+    *recheck = hb->since + recover_ms - now;
+    /* Quiet again after flapping, but not yet recovered long enough */
+    return old == HIPI_UPS_HEARTBEAT_FLAPPING ? HIPI_UPS_HEARTBEAT_MISSING : old;
+}
+
+#endif /* HIPI_UPS_LOGIC_H */
@@ -0,0 +1,106 @@
+#include <linux/power_supply.h>
+
+#include "hipi-ups.h"
+
+static const enum power_supply_property hipi_ups_psy_props[] = {
+    POWER_SUPPLY_PROP_ONLINE,
+    POWER_SUPPLY_PROP_PRESENT,
+    POWER_SUPPLY_PROP_STATUS,
+    POWER_SUPPLY_PROP_CAPACITY_LEVEL,
+    POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW,
+    POWER_SUPPLY_PROP_TIME_TO_FULL_NOW,
+    POWER_SUPPLY_PROP_SCOPE,
+};
+
+static int hipi_ups_psy_get_property(struct power_supply *psy, enum power_supply_property psp,
+                                     union power_supply_propval *val)
+{
+    struct gpio_data *data = power_supply_get_drvdata(psy);
+    struct hipi_ups_snapshot snap;
+    s64 estimate;
+
+    hipi_ups_snapshot(data, &snap);
+
+    switch (psp) {
+    case POWER_SUPPLY_PROP_ONLINE:
+        /* Mains present */
+        val->intval = !snap.power_fault;
+        break;
+    case POWER_SUPPLY_PROP_PRESENT:
+        val->intval = snap.ups_online;
+        break;
+    case POWER_SUPPLY_PROP_STATUS:
+        if (snap.power_fault)
+            val->intval = POWER_SUPPLY_STATUS_DISCHARGING;
+        else if (snap.charging)
+            val->intval = POWER_SUPPLY_STATUS_CHARGING;
+        else if (data->charging_desc)
+            val->intval = POWER_SUPPLY_STATUS_FULL;
+        else
+            val->intval = POWER_SUPPLY_STATUS_NOT_CHARGING;
+        break;
+    case POWER_SUPPLY_PROP_CAPACITY_LEVEL:
+        if (!data->battery_low_desc)
+            val->intval = POWER_SUPPLY_CAPACITY_LEVEL_UNKNOWN;
+        else if (snap.battery_low)
+            val->intval = POWER_SUPPLY_CAPACITY_LEVEL_CRITICAL;
+        else
+            val->intval = POWER_SUPPLY_CAPACITY_LEVEL_NORMAL;
+        break;
+    case POWER_SUPPLY_PROP_TIME_TO_EMPTY_NOW:
+        /* As far as the host is concerned, the battery runs out when the
+         * shutdown countdown does.
+         */
+        if (!snap.shutdown_pending) return -ENODATA;
+        val->intval = div_u64(snap.shutdown_remaining_ms, MSEC_PER_SEC);
+        break;
+    case POWER_SUPPLY_PROP_TIME_TO_FULL_NOW:
+        estimate = hipi_ups_recharge_estimate_ms(data);
+        if (estimate < 0) return -ENODATA;
+        val->intval = div_s64(estimate, MSEC_PER_SEC);
+        break;
+    case POWER_SUPPLY_PROP_SCOPE:
+        val->intval = POWER_SUPPLY_SCOPE_SYSTEM;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* devm action, run before the power supply is unregistered: the IRQs and work
+ * that call notify_work are still live, so stop it using the power supply.
+ */
+static void hipi_ups_power_supply_unpublish(void *arg)
+{
+    struct gpio_data *data = arg;
+
+    WRITE_ONCE(data->psy, NULL);
+    cancel_work_sync(&data->notify_work);
+}
+
+/* Register the instance with the power_supply class, named after the
+ * instance. Outage accounting lives in the parent device's stats/ group.
+ */
+int hipi_ups_power_supply_register(struct gpio_data *data)
+{
+    struct power_supply_config cfg = { .drv_data = data };
+    struct power_supply_desc *desc;
+    struct power_supply *psy;
+
+    desc = devm_kzalloc(data->dev, sizeof(*desc), GFP_KERNEL);
+    if (!desc) return -ENOMEM;
+
+    desc->name = data->name;
+    desc->type = POWER_SUPPLY_TYPE_UPS;
+    desc->properties = hipi_ups_psy_props;
+    desc->num_properties = ARRAY_SIZE(hipi_ups_psy_props);
+    desc->get_property = hipi_ups_psy_get_property;
+
+    psy = devm_power_supply_register(data->dev, desc, &cfg);
+    if (IS_ERR(psy)) return PTR_ERR(psy);
+
+    WRITE_ONCE(data->psy, psy);
+    return devm_add_action_or_reset(data->dev, hipi_ups_power_supply_unpublish, data);
+}
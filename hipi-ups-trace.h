@@ -0,0 +1,34 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hipi_ups
+
+#if !defined(HIPI_UPS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define HIPI_UPS_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* Time from the power fault hard IRQ to power_irq_handler() running */
+TRACE_EVENT(hipi_ups_power_latency,
+    TP_PROTO(const char *name, u64 latency_us, bool slo_missed),
+    TP_ARGS(name, latency_us, slo_missed),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(u64, latency_us)
+        __field(bool, slo_missed)
+    ),
+    TP_fast_assign(
+        __assign_str(name);
+        __entry->latency_us = latency_us;
+        __entry->slo_missed = slo_missed;
+    ),
+    TP_printk("ups=%s latency_us=%llu slo_missed=%d",
+              __get_str(name), __entry->latency_us, __entry->slo_missed)
+);
+
+#endif /* HIPI_UPS_TRACE_H */
+
+/* Out of tree, the header sits next to the sources; see CFLAGS in the Makefile */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hipi-ups-trace
+#include <trace/define_trace.h>
@@ -0,0 +1,245 @@
+#ifndef HIPI_UPS_H
+#define HIPI_UPS_H
+
+#include <linux/gpio/consumer.h>
+#include <linux/list.h>
+#include <linux/mod_devicetable.h>
+#include <linux/mutex.h>
+#include <linux/ratelimit.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/timer.h>
+#include <linux/types.h>
+#include <linux/workqueue.h>
+
+#include "hipi-ups-logic.h"
+
+/* How the Pi reports its own state to the UPS on the status line */
+enum hipi_ups_status_protocol {
+    HIPI_UPS_STATUS_LEVEL,     /* Low while running, high once stopping */
+    HIPI_UPS_STATUS_HEARTBEAT, /* Toggled every status_period_ms while running, high once stopping */
+};
+
+/* Power fault handling latency histogram, upper bounds in us; the last
+ * bucket catches everything slower.
+ */
+#define HIPI_UPS_LATENCY_BUCKETS 10
+extern const u32 hipi_ups_latency_bounds_us[HIPI_UPS_LATENCY_BUCKETS - 1];
+
+/* Lines a board may leave unconnected */
+#define HIPI_UPS_STATUS_OPTIONAL BIT(0)
+#define HIPI_UPS_ONLINE_OPTIONAL BIT(1)
+
+/* Per-HAT description, selected by compatible string (see hipi-ups-boards.c).
+ * Polarity flags are applied on top of the GPIO flags given in Device Tree, so
+ * overlays can keep describing the pins as plain active high.
+ */
+struct hipi_ups_board {
+    const char *name;
+    unsigned int optional_lines;  /* HIPI_UPS_*_OPTIONAL */
+    bool power_active_low;        /* Power fault line reads low during a fault */
+    bool status_active_low;       /* UPS expects "stopping" as a low level */
+    enum hipi_ups_status_protocol status_protocol;
+    unsigned int status_period_ms;     /* HIPI_UPS_STATUS_HEARTBEAT toggle period */
+    unsigned int shutdown_delay_ms;    /* Wait this long after a power fault before poweroff, in case power returns */
+    unsigned int heartbeat_timeout_ms; /* UPS heartbeat watchdog */
+    unsigned int heartbeat_recover_ms; /* Heartbeat must be back this long before it's reported present */
+    unsigned int restore_stable_ms;    /* Mains must stay up this long before a shutdown is cancelled */
+};
+
+extern const struct hipi_ups_board hipi_ups_board_hipi;
+extern const struct of_device_id hipi_ups_of_match[];
+extern const struct platform_device_id hipi_ups_id_table[];
+
+/* Input lines, for per-line statistics */
+enum hipi_ups_line {
+    HIPI_UPS_LINE_POWER,
+    HIPI_UPS_LINE_ONLINE,
+    HIPI_UPS_LINE_BATTERY_LOW,
+    HIPI_UPS_LINE_CHARGING,
+    HIPI_UPS_LINE_COUNT,
+};
+
+/* Console message classes, each with its own log level and ratelimit */
+enum hipi_ups_log_class {
+    HIPI_UPS_LOG_POWER,          /* Power lost / back / restored */
+    HIPI_UPS_LOG_HEARTBEAT_LOST, /* UPS heartbeat missing */
+    HIPI_UPS_LOG_HEARTBEAT,      /* UPS heartbeat back */
+    HIPI_UPS_LOG_BATTERY,        /* Battery low / charging changes */
+    HIPI_UPS_LOG_LATENCY,        /* Power fault handled later than power_latency_slo_us */
+    HIPI_UPS_LOG_COUNT,
+};
+
+extern const char * const hipi_ups_log_class_names[HIPI_UPS_LOG_COUNT];
+
+/* Counters behind the metrics file. Protected by gpio_data.lock. */
+struct hipi_ups_stats {
+    u64 edges[HIPI_UPS_LINE_COUNT];
+    u64 missed_edges[HIPI_UPS_LINE_COUNT]; /* Line levels found out of step with the state */
+    u64 heartbeat_intervals; /* Number of heartbeat intervals measured */
+    u64 heartbeat_interval_sum_us;
+    u64 heartbeat_interval_min_us;
+    u64 heartbeat_interval_max_us;
+    u64 heartbeat_interval_last_us;
+    u64 watchdog_expiries;   /* Heartbeat watchdog timeouts, i.e. heartbeat-loss episodes */
+    u64 heartbeat_flaps;     /* Times the heartbeat was reported flapping */
+    u64 power_latency[HIPI_UPS_LATENCY_BUCKETS]; /* Power fault hard IRQ to handler, see hipi_ups_latency_bounds_us */
+    u64 power_latency_sum_us;
+    u64 power_latency_max_us;
+    u64 power_latency_slo_misses; /* Edges handled later than power_latency_slo_us */
+    u64 outages;             /* Power faults seen */
+    u64 on_battery_ms;       /* Time on battery over completed outages */
+    u64 outage_last_ms;      /* Duration of the last completed outage */
+    u64 outage_longest_ms;
+    u64 shutdowns_cancelled; /* Countdowns stopped by power returning */
+    u64 shutdowns_executed;  /* Countdowns that powered the host off */
+    u64 shutdowns_held;      /* Countdowns that expired without the shutdown quorum */
+    u64 restores_unstable;   /* Mains came back but dropped again within restore_stable_ms */
+    u64 outage_start_time;   /* Wall clock (s since the epoch) of the last outage's start */
+    u64 outage_end_time;     /* ... and end, 0 if none yet */
+    u64 heartbeat_loss_time; /* Wall clock of the last heartbeat loss */
+    u64 log_suppressed[HIPI_UPS_LOG_COUNT]; /* Console messages dropped by the ratelimit */
+};
+
+/* Consistent copy of one instance's state, for reporting */
+struct hipi_ups_snapshot {
+    const char *name;
+    u64 power_state; /* enum hipi_ups_power_state */
+    u64 power_fault;
+    u64 ups_online;
+    u64 heartbeat_state; /* enum hipi_ups_heartbeat_state */
+    u64 battery_low;
+    u64 charging;
+    u64 shutdown_pending;
+    u64 shutdown_remaining_ms;
+    u64 on_battery_ms; /* Including the current outage */
+    struct hipi_ups_stats stats;
+};
+
+struct gpio_data {
+    const struct hipi_ups_board *board;
+    struct gpio_desc *power_desc;  /* For power fault detection (Input) */
+    struct gpio_desc *status_desc; /* For sending Pi status to UPS (Output) */
+    struct gpio_desc *ups_online_desc; /* For detecting if UPS is online (Input)*/
+    struct gpio_desc *battery_low_desc; /* Optional: battery nearly empty (Input) */
+    struct gpio_desc *charging_desc;    /* Optional: charger active (Input) */
+    int power_irq;
+    ktime_t power_irq_time; /* Hard IRQ timestamp of the edge being handled, 0 if none */
+    int ups_online_irq;
+    int battery_low_irq; /* < 0 if the line is sampled instead */
+    int charging_irq;
+    struct delayed_work shutdown_work;
+    struct delayed_work warn_work; /* Sends the shutdown warning stages */
+    struct delayed_work restore_work; /* Ends an outage once mains has been stable */
+    struct delayed_work status_work; /* Drives HIPI_UPS_STATUS_HEARTBEAT */
+    struct delayed_work sample_work; /* Polls optional lines that have no IRQ */
+    struct timer_list ups_online_timer;
+    struct delayed_work heartbeat_work; /* Debounces the raw heartbeat into heartbeat_state */
+    struct work_struct notify_work; /* Tells userspace about state changes */
+    struct delayed_work reconcile_work; /* Catches edges the IRQs missed */
+    struct device *dev; /* Reference for logging */
+    int id;           /* Instance index, unique among probed UPSes */
+    const char *name; /* DT "label", or "hipi-ups<id>" */
+    unsigned int shutdown_delay_ms;    /* Board default or DT "shutdown-delay-ms" */
+    unsigned int heartbeat_timeout_ms; /* Board default or DT "heartbeat-timeout-ms", 0 = not watched */
+    unsigned int status_period_ms;     /* Board default or DT "status-period-ms" */
+    unsigned int restore_stable_ms;    /* Board default or DT "restore-stable-ms" */
+    unsigned int heartbeat_recover_ms; /* Board default or DT "heartbeat-recover-ms" */
+    unsigned int flap_window_ms;       /* DT "heartbeat-flap-window-ms" */
+    unsigned int flap_threshold;       /* DT "heartbeat-flap-threshold", raw transitions per window */
+    bool power_fault; /* Power fault line level */
+    enum hipi_ups_power_state power_state; /* Protected by lock */
+    enum hipi_ups_heartbeat_state heartbeat_state; /* Protected by lock */
+    bool status_level; /* Last level driven on the status line */
+    bool battery_low;
+    bool charging;
+
+    /* Recharge estimation, all times CLOCK_BOOTTIME in ms. Protected by lock. */
+    spinlock_t lock;
+    s64 on_battery_since;  /* Start of the current power fault */
+    s64 charging_since;    /* Start of the current charge */
+    s64 deficit_ms;        /* Time on battery not yet made up by charging */
+    u32 charge_per_discharge; /* Learned ms of charging per 1000 ms on battery, 0 = unknown */
+    s64 shutdown_deadline; /* When shutdown_work fires, 0 if not pending */
+    u32 warn_sent_ms;      /* Latest warning stage sent this countdown, U32_MAX if none */
+    ktime_t last_heartbeat;
+    struct hipi_ups_heartbeat heartbeat; /* Raw heartbeat behind heartbeat_state */
+    struct hipi_ups_stats stats;
+    struct power_supply *psy; /* NULL without CONFIG_HIPI_UPS_POWER_SUPPLY or once unregistering */
+    struct ratelimit_state log_rs[HIPI_UPS_LOG_COUNT];
+    unsigned int log_pending[HIPI_UPS_LOG_COUNT]; /* Suppressed since the last message; protected by lock */
+
+    struct list_head node; /* Entry in hipi_ups_instances */
+    bool listed;    /* On hipi_ups_instances; protected by hipi_ups_lock */
+    bool exhausted; /* Power failure outlasted shutdown_delay_ms; protected by hipi_ups_lock */
+};
+
+/* All probed instances, see hipi-ups-core.c */
+extern struct list_head hipi_ups_instances;
+extern struct mutex hipi_ups_lock;
+
+/* CPU hotplug while on battery, see hipi-ups-cpu.c */
+struct hipi_ups_cpu_stats {
+    u64 offlines;        /* CPUs taken offline */
+    u64 onlines;         /* CPUs brought back */
+    u64 offline_last_us; /* Duration of the last remove_cpu() */
+    u64 offline_max_us;
+    u64 online_last_us;  /* Duration of the last add_cpu() */
+    u64 online_max_us;
+    u64 cpus_down;       /* CPUs currently offline on our account */
+};
+
+void hipi_ups_snapshot(struct gpio_data *data, struct hipi_ups_snapshot *snap);
+bool hipi_ups_host_on_battery(void);
+s64 hipi_ups_recharge_estimate_ms(struct gpio_data *data);
+
+#ifdef CONFIG_HIPI_UPS_POWER_SUPPLY
+int hipi_ups_power_supply_register(struct gpio_data *data);
+#else
+static inline int hipi_ups_power_supply_register(struct gpio_data *data) { return 0; }
+#endif
+
+#ifdef CONFIG_HIPI_UPS_CPU_HOTPLUG
+void hipi_ups_cpu_update(void);
+void hipi_ups_cpu_stats_get(struct hipi_ups_cpu_stats *stats);
+void hipi_ups_cpu_exit(void);
+#else
+static inline void hipi_ups_cpu_update(void) { }
+static inline void hipi_ups_cpu_stats_get(struct hipi_ups_cpu_stats *stats) { memset(stats, 0, sizeof(*stats)); }
+static inline void hipi_ups_cpu_exit(void) { }
+#endif
+
+/* Shutdown policy hooks, see hipi-ups-bpf.c. Each returns def when no
+ * policy is attached.
+ */
+#ifdef CONFIG_HIPI_UPS_POLICY
+int hipi_ups_bpf_init(void);
+s32 hipi_ups_policy_on_battery(struct gpio_data *data, s32 def);
+s32 hipi_ups_policy_heartbeat_lost(struct gpio_data *data, s32 def);
+s32 hipi_ups_policy_countdown_expired(struct gpio_data *data, s32 def);
+void hipi_ups_policy_restored(struct gpio_data *data);
+#else
+static inline int hipi_ups_bpf_init(void) { return 0; }
+static inline s32 hipi_ups_policy_on_battery(struct gpio_data *data, s32 def) { return def; }
+static inline s32 hipi_ups_policy_heartbeat_lost(struct gpio_data *data, s32 def) { return def; }
+static inline s32 hipi_ups_policy_countdown_expired(struct gpio_data *data, s32 def) { return def; }
+static inline void hipi_ups_policy_restored(struct gpio_data *data) { }
+#endif
+
+#ifdef CONFIG_HIPI_UPS_CONFIGFS
+int hipi_ups_configfs_init(void);
+void hipi_ups_configfs_exit(void);
+#else
+static inline int hipi_ups_configfs_init(void) { return 0; }
+static inline void hipi_ups_configfs_exit(void) { }
+#endif
+
+#ifdef CONFIG_HIPI_UPS_DEBUGFS
+int hipi_ups_debugfs_init(void);
+void hipi_ups_debugfs_exit(void);
+#else
+static inline int hipi_ups_debugfs_init(void) { return 0; }
+static inline void hipi_ups_debugfs_exit(void) { }
+#endif
+
+#endif /* HIPI_UPS_H */
@@ -0,0 +1,289 @@
+/* hipi-ups-bench: event delivery latency through hipi-ups.hpp.
+ *
+ * Flips an instance's power state from a second thread and measures the time
+ * from the flip to the monitor delivering the change, through either the
+ * batch read() or the coroutine API.
+ *
+ * By default the instance is a fake sysfs tree whose power_state file is
+ * rewritten, which is watched with inotify and measures the library alone.
+ * With --sim, the driver itself watches a gpio-sim line through a configfs
+ * instance and the line is toggled, so the figure covers the IRQ, the
+ * driver's sysfs_notify() and the POLLPRI wakeup. That needs root, gpio-sim
+ * and the module built with CONFIG_HIPI_UPS_CONFIGFS.
+ *
+ * Build: make -C tools
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "hipi-ups.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+static std::atomic<clock_type::rep> written; /* When the last change was written */
+static std::atomic<unsigned> acked;         /* Changes seen by the reader */
+static unsigned target;                     /* Instance being measured */
+static bool on_battery;                     /* Its last state seen by the reader */
+
+#define SIM_CHIP "/sys/kernel/config/gpio-sim/hipi-ups-bench"
+#define SIM_UPS "/sys/kernel/config/hipi-ups/bench"
+
+static void write_file(const std::string &path, const char *value)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd < 0 || write(fd, value, strlen(value)) < 0) {
+        perror(path.c_str());
+        exit(1);
+    }
+    close(fd);
+}
+
+static std::string make_tree()
+{
+    char root[] = "/tmp/hipi-ups-bench.XXXXXX";
+    std::string dir;
+
+    if (!mkdtemp(root)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+    dir = root;
+    for (const char *sub : { "/bus", "/platform", "/drivers", "/hipi_ups", "/ups.0" }) {
+        dir += sub;
+        mkdir(dir.c_str(), 0755);
+    }
+    write_file(dir + "/label", "ups\n");
+    write_file(dir + "/power_state", "mains  \n");
+    write_file(dir + "/heartbeat_state", "present\n");
+    write_file(dir + "/ups_online", "1\n");
+    write_file(dir + "/battery_low", "0\n");
+    write_file(dir + "/charging", "0\n");
+    return root;
+}
+
+static void remove_tree(const std::string &root)
+{
+    std::string dir = root + "/bus/platform/drivers/hipi_ups/ups.0";
+
+    for (const char *f : { "label", "power_state", "heartbeat_state", "ups_online", "battery_low", "charging" })
+        unlink((dir + "/" + f).c_str());
+    for (const char *sub : { "/bus/platform/drivers/hipi_ups/ups.0", "/bus/platform/drivers/hipi_ups",
+                             "/bus/platform/drivers", "/bus/platform", "/bus", "" })
+        rmdir((root + sub).c_str());
+}
+
+/* Write a sysfs or configfs attribute, false on failure */
+static bool write_attr(const std::string &path, const char *value)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    bool ok = fd >= 0 && write(fd, value, strlen(value)) >= 0;
+
+    if (!ok) perror(path.c_str());
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+static std::string read_attr(const std::string &path)
+{
+    char buf[64];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd >= 0 ? read(fd, buf, sizeof(buf)) : -1;
+
+    if (fd >= 0) close(fd);
+    while (n > 0 && buf[n - 1] == '\n') n--;
+    return n > 0 ? std::string(buf, n) : std::string();
+}
+
+/* A one-line gpio-sim chip with a configfs instance watching it as the power
+ * fault line. Returns the line's pull attribute, empty on failure.
+ */
+static std::string sim_setup()
+{
+    std::string pull;
+
+    mkdir(SIM_CHIP, 0755);
+    mkdir(SIM_CHIP "/bank0", 0755);
+    if (!write_attr(SIM_CHIP "/bank0/num_lines", "1") || !write_attr(SIM_CHIP "/bank0/label", "hipi-ups-bench") ||
+        !write_attr(SIM_CHIP "/live", "1"))
+        return { };
+    pull = "/sys/devices/platform/" + read_attr(SIM_CHIP "/dev_name") + "/" + read_attr(SIM_CHIP "/bank0/chip_name") +
+           "/sim_gpio0/pull";
+
+    if (mkdir(SIM_UPS, 0755)) {
+        perror(SIM_UPS);
+        return { };
+    }
+    if (!write_attr(SIM_UPS "/board", "gpio_ups") || !write_attr(SIM_UPS "/power_gpio", "hipi-ups-bench:0") ||
+        !write_attr(SIM_UPS "/shutdown_delay_ms", "3600000") || !write_attr(SIM_UPS "/enable", "1"))
+        return { };
+    return pull;
+}
+
+static void sim_teardown()
+{
+    write_attr(SIM_UPS "/enable", "0");
+    rmdir(SIM_UPS);
+    write_attr(SIM_CHIP "/live", "0");
+    rmdir(SIM_CHIP "/bank0");
+    rmdir(SIM_CHIP);
+}
+
+/* The instance probes asynchronously, so wait a little for it to show up */
+static std::unique_ptr<hipi_ups::monitor> sim_monitor()
+{
+    for (int tries = 0; tries < 40; tries++) {
+        try {
+            auto mon = std::make_unique<hipi_ups::monitor>();
+
+            for (target = 0; target < mon->upses().size(); target++)
+                if (mon->upses()[target].name == "bench") return mon;
+        } catch (const std::system_error &) {
+        }
+        usleep(50000);
+    }
+    throw std::system_error(ENODEV, std::generic_category(), "bench instance");
+}
+
+/* Flip the power state once per change the reader has acknowledged. The
+ * fake tree's values are the same length and written in place, so the
+ * reader never sees a truncated file.
+ */
+static void writer(std::string path, unsigned count, const char *fault, const char *mains)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
+    unsigned seen;
+
+    if (fd < 0) {
+        perror(path.c_str());
+        exit(1);
+    }
+    for (unsigned i = 0; i < count; i++) {
+        while ((seen = acked.load(std::memory_order_acquire)) != i) acked.wait(seen, std::memory_order_acquire);
+        written.store(clock_type::now().time_since_epoch().count(), std::memory_order_release);
+        const char *value = i % 2 ? mains : fault;
+
+        if (pwrite(fd, value, strlen(value), 0) != (ssize_t)strlen(value)) {
+            perror(path.c_str());
+            exit(1);
+        }
+    }
+    close(fd);
+}
+
+/* Only going on or off battery counts: the driver also passes through
+ * restoring on the way back to mains.
+ */
+static void record(const hipi_ups::event &ev, std::vector<double> &lat)
+{
+    if (ev.ups != target || ev.which != hipi_ups::attr::power_state) return;
+    if ((ev.power() == hipi_ups::power_state::battery) == on_battery) return;
+    on_battery = !on_battery;
+    lat.push_back((ev.when.time_since_epoch().count() - written.load(std::memory_order_acquire)) *
+                  1e6 * clock_type::period::num / clock_type::period::den);
+    acked.fetch_add(1, std::memory_order_release);
+    acked.notify_one();
+}
+
+static hipi_ups::task consume(hipi_ups::monitor &mon, std::vector<double> &lat, unsigned count)
+{
+    while (lat.size() < count) record(co_await mon.next_event(), lat);
+}
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p / 100 * sorted.size()))];
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-n count] [-a read|coro] [-s]\n"
+            "  -n, --count  Changes to measure (default 10000)\n"
+            "  -a, --api    Deliver through read() or next_event() (default read)\n"
+            "  -s, --sim    Measure the driver on a gpio-sim line instead of a\n"
+            "               fake sysfs tree\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option opts[] = {
+        { "count", required_argument, NULL, 'n' },
+        { "api", required_argument, NULL, 'a' },
+        { "sim", no_argument, NULL, 's' },
+        { "help", no_argument, NULL, 'h' },
+        { }
+    };
+    unsigned count = 10000;
+    bool coro = false, sim = false;
+    std::vector<double> lat;
+    std::string root, pull;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "n:a:sh", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'n': count = strtoul(optarg, NULL, 10); break;
+        case 'a': coro = !strcmp(optarg, "coro"); break;
+        case 's': sim = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (!count) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (sim) {
+        pull = sim_setup();
+        if (pull.empty()) {
+            sim_teardown();
+            return 1;
+        }
+    } else {
+        root = make_tree();
+    }
+    lat.reserve(count);
+    try {
+        std::unique_ptr<hipi_ups::monitor> mon = sim ? sim_monitor() : std::make_unique<hipi_ups::monitor>(root);
+        std::thread t = sim ? std::thread(writer, pull, count, "pull-up", "pull-down")
+                            : std::thread(writer, mon->upses()[0].dir + "/power_state", count, "battery\n", "mains  \n");
+
+        if (coro) {
+            consume(*mon, lat, count);
+            while (lat.size() < count) mon->dispatch();
+        } else {
+            while (lat.size() < count)
+                for (const hipi_ups::event &ev : mon->read(-1)) record(ev, lat);
+        }
+        t.join();
+    } catch (const std::system_error &e) {
+        fprintf(stderr, "%s\n", e.what());
+        if (sim) sim_teardown();
+        else remove_tree(root);
+        return 1;
+    }
+    if (sim) sim_teardown();
+    else remove_tree(root);
+
+    std::sort(lat.begin(), lat.end());
+    printf("%u %s changes through %s: min %.1f p50 %.1f p90 %.1f p99 %.1f max %.1f us\n",
+           count, sim ? "driver" : "fake tree", coro ? "next_event()" : "read()", lat.front(), percentile(lat, 50),
+           percentile(lat, 90), percentile(lat, 99), lat.back());
+    return 0;
+}
@@ -0,0 +1,91 @@
+#!/bin/sh
+# hipi-ups-gpiod-bench: power fault reaction latency and CPU cost of
+# hipi-ups-gpiod against the driver, on the same simulated line.
+#
+# Needs root, configfs, debugfs, gpio-sim and the hipi_ups module loaded with
+# CONFIG_HIPI_UPS_STATS and CONFIG_HIPI_UPS_CONFIGFS. Toggles line 0 of a
+# gpio-sim chip through its pull, first watched by the daemon and then by a
+# configfs instance, and compares the edge-to-handler latency each reports
+# with the CPU time spent handling the edges.
+#
+# Usage: sudo tools/hipi-ups-gpiod-bench.sh [edges]
+set -e
+
+EDGES=${1:-2000}
+TOOLS=$(dirname "$0")
+SIM=/sys/kernel/config/gpio-sim/hipi-ups-bench
+UPS=/sys/kernel/config/hipi-ups/bench
+METRICS=/sys/kernel/debug/hipi-ups/metrics
+LOG=$(mktemp)
+
+cleanup() {
+    [ -n "$DAEMON" ] && kill "$DAEMON" 2>/dev/null && wait "$DAEMON" 2>/dev/null
+    if [ -d "$UPS" ]; then
+        echo 0 > "$UPS/enable" 2>/dev/null || true
+        rmdir "$UPS"
+    fi
+    if [ -d "$SIM" ]; then
+        echo 0 > "$SIM/live"
+        rmdir "$SIM/bank0" "$SIM"
+    fi
+    rm -f "$LOG"
+}
+trap cleanup EXIT
+
+# Clock ticks of CPU time (utime + stime) used by a process or thread
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+# Toggle the power fault line EDGES times, ending with mains present
+toggle() {
+    i=0
+    while [ "$i" -lt "$EDGES" ]; do
+        echo pull-up > "$PULL"
+        echo pull-down > "$PULL"
+        i=$((i + 2))
+    done
+}
+
+modprobe gpio-sim
+mkdir "$SIM" "$SIM/bank0"
+echo 1 > "$SIM/bank0/num_lines"
+echo 1 > "$SIM/live"
+CHIP=$(cat "$SIM/bank0/chip_name")
+DEV=$(cat "$SIM/dev_name")
+PULL=/sys/devices/platform/$DEV/$CHIP/sim_gpio0/pull
+TICK_US=$((1000000 / $(getconf CLK_TCK)))
+
+# The daemon, without a heartbeat and never actually powering off
+"$TOOLS/hipi-ups-gpiod" --chip "/dev/$CHIP" --power 0 --heartbeat-timeout 0 \
+    --shutdown-delay 3600000 --dry-run 2> "$LOG" &
+DAEMON=$!
+sleep 1
+toggle
+sleep 1
+kill "$DAEMON"
+wait "$DAEMON" || true
+DAEMON=
+tail -n 1 "$LOG" | awk '{
+    printf "hipi-ups-gpiod: %d edges, latency avg %d us max %d us, cpu %d us\n", $3, $6, $9, $12
+}'
+
+# The driver on the same line
+mkdir "$UPS"
+echo gpio_ups > "$UPS/board"
+echo "$DEV-node0:0" > "$UPS/power_gpio"
+echo 3600000 > "$UPS/shutdown_delay_ms"
+echo 1 > "$UPS/enable"
+IRQ_THREAD=$(pgrep '^irq/[0-9]+-bench' | head -n 1) # Names are cut to 15 characters
+START=$(cpu_ticks "$IRQ_THREAD")
+toggle
+sleep 1
+CPU_US=$(( ($(cpu_ticks "$IRQ_THREAD") - START) * TICK_US ))
+awk -v cpu="$CPU_US" '
+    /^hipi_ups_power_latency_seconds_sum\{ups="bench"\}/ { sum = $2 }
+    /^hipi_ups_power_latency_seconds_count\{ups="bench"\}/ { count = $2 }
+    /^hipi_ups_power_latency_max_seconds\{ups="bench"\}/ { max = $2 }
+    END {
+        printf "hipi-ups:       %d edges, latency avg %d us max %d us, cpu %d us (IRQ thread only)\n",
+               count, count ? sum / count * 1e6 : 0, max * 1e6, cpu
+    }' "$METRICS"
@@ -0,0 +1,526 @@
+/* hipi-ups-gpiod: the hipi-ups driver's job, from userspace.
+ *
+ * For hosts that can't load out-of-tree modules, e.g. under secure boot.
+ * Watches the power fault, UPS heartbeat and optional battery-low lines
+ * through the GPIO character device, drives the status line, and powers off
+ * through systemd after a sustained power failure. Every decision comes from
+ * hipi-ups-logic.h, shared with the driver; timings default to the HiPi
+ * board's.
+ *
+ * Edges arrive with the kernel's CLOCK_MONOTONIC timestamps and are read in
+ * batches. As the driver does, the line levels are also read back every
+ * RECONCILE_INTERVAL_MS and whenever a gap in an edge sequence number shows
+ * that the kernel dropped events, so a lost edge can't leave us out of step.
+ *
+ * Build: make -C tools
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/gpio.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../hipi-ups-logic.h"
+
+#define EVENT_BATCH 16
+#define RECONCILE_INTERVAL_MS 10000 /* The driver's reconcile_interval_ms */
+
+enum line {
+    LINE_POWER,
+    LINE_ONLINE,
+    LINE_BATTERY_LOW,
+    LINE_COUNT,
+};
+
+extern char **environ;
+
+/* Settings, defaulting to the HiPi board */
+static const char *chip_path = "/dev/gpiochip0";
+static int line_offset[LINE_COUNT] = { -1, -1, -1 }; /* -1 if not connected */
+static int status_offset = -1;
+static bool power_active_low;
+static unsigned int status_period_ms; /* Toggle the status line this often, 0 = level */
+static unsigned int shutdown_delay_ms = 60000;
+static unsigned int heartbeat_timeout_ms = 2000;
+static unsigned int heartbeat_recover_ms = 2000;
+static unsigned int restore_stable_ms = 5000;
+static unsigned int flap_window_ms = 60000;
+static unsigned int flap_threshold = 6;
+static const char *shutdown_cmd = "systemctl poweroff";
+static bool dry_run;
+
+/* State, as in the driver's struct gpio_data */
+static enum hipi_ups_power_state power_state;
+static enum hipi_ups_heartbeat_state heartbeat_state;
+static struct hipi_ups_heartbeat heartbeat;
+static bool power_fault, battery_low, status_level, stopping;
+static s64 shutdown_at, restore_at, watchdog_at, heartbeat_at, status_at, reconcile_at; /* Monotonic ms, 0 = not armed */
+
+static int lines_fd = -1, status_fd = -1;
+static unsigned int line_index[LINE_COUNT]; /* Position in the line request */
+static __u64 lines_mask; /* Every line in the request */
+static unsigned int line_seqno[LINE_COUNT]; /* Last edge seen on each line */
+
+/* Power fault edge to handling, comparable with the driver's power_latency */
+static unsigned long long latency_edges, latency_sum_us, latency_max_us;
+static volatile sig_atomic_t want_stats, want_quit;
+
+static void logmsg(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+static s64 now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (s64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void status_set(bool level)
+{
+    struct gpio_v2_line_values v = { .bits = level, .mask = 1 };
+
+    status_level = level;
+    if (status_fd >= 0 && ioctl(status_fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &v))
+        logmsg("Can't set the status line: %s\n", strerror(errno));
+}
+
+/* Start the shutdown countdown, or bring it forward if delay_ms is sooner */
+static void schedule_shutdown(s64 now, unsigned int delay_ms)
+{
+    if (!shutdown_at || now + delay_ms < shutdown_at) shutdown_at = now + delay_ms;
+}
+
+static void poweroff(void)
+{
+    char *argv[] = { "/bin/sh", "-c", (char *)shutdown_cmd, NULL };
+    pid_t pid;
+    int err;
+
+    logmsg("Power failure persisted for %u ms. Initiating shutdown.\n", shutdown_delay_ms);
+    stopping = true;
+    if (dry_run) return;
+    err = posix_spawn(&pid, argv[0], NULL, NULL, argv, environ);
+    if (err) logmsg("Can't run \"%s\": %s\n", shutdown_cmd, strerror(err));
+}
+
+/* Carry out a hipi-ups-logic.h decision */
+static void act(const struct hipi_ups_action *act, s64 now)
+{
+    if (act->msg) logmsg(act->msg, act->ms);
+    if (act->todo & HIPI_UPS_DO_RESTORE_STOP) restore_at = 0;
+    if (act->todo & HIPI_UPS_DO_SHUTDOWN_NOW) schedule_shutdown(now, 0);
+    if (act->todo & HIPI_UPS_DO_COUNTDOWN) schedule_shutdown(now, act->ms);
+    if (act->todo & HIPI_UPS_DO_RESTORE_START) restore_at = now + act->ms;
+    if (act->todo & HIPI_UPS_DO_RESTORED) {
+        power_state = HIPI_UPS_POWER_MAINS;
+        shutdown_at = 0;
+    }
+}
+
+static void power_changed(bool fault, s64 now)
+{
+    enum hipi_ups_power_state old = power_state;
+    struct hipi_ups_action a;
+
+    if (fault == power_fault) return;
+    power_fault = fault;
+    power_state = hipi_ups_power_next(old, fault);
+
+    a = hipi_ups_power_action(old, fault, battery_low, shutdown_delay_ms, restore_stable_ms);
+    act(&a, now);
+}
+
+static void battery_low_changed(bool low, s64 now)
+{
+    struct hipi_ups_action a;
+
+    if (low == battery_low) return;
+    battery_low = low;
+
+    a = hipi_ups_battery_low_action(low, power_fault);
+    act(&a, now);
+}
+
+static void heartbeat_update(s64 now)
+{
+    enum hipi_ups_heartbeat_state old = heartbeat_state;
+    unsigned int transitions;
+    s64 recheck;
+
+    heartbeat_state = hipi_ups_heartbeat_next(&heartbeat, old, now, heartbeat_recover_ms, flap_window_ms,
+                                              flap_threshold, &transitions, &recheck);
+    heartbeat_at = recheck > 0 ? now + recheck : 0;
+    if (heartbeat_state == old) return;
+
+    switch (heartbeat_state) {
+    case HIPI_UPS_HEARTBEAT_PRESENT:
+        logmsg("UPS heartbeat detected (Online).\n");
+        break;
+    case HIPI_UPS_HEARTBEAT_MISSING:
+        logmsg("UPS heartbeat missing! Check hardware connections.\n");
+        break;
+    case HIPI_UPS_HEARTBEAT_FLAPPING:
+        logmsg("UPS heartbeat flapping (%u transitions in %u ms)!\n", transitions, flap_window_ms);
+        break;
+    default:
+        break;
+    }
+}
+
+static void heartbeat_edge(s64 now)
+{
+    bool recovered = !heartbeat.raw;
+
+    hipi_ups_heartbeat_set_raw(&heartbeat, true, now);
+    if (recovered) heartbeat_update(now);
+    watchdog_at = now + heartbeat_timeout_ms;
+}
+
+/* Read the power fault and battery-low levels back and catch up on any edge
+ * that was lost, like the driver's hipi_ups_reconcile()
+ */
+static void lines_reconcile(s64 now)
+{
+    struct gpio_v2_line_values v = { .mask = lines_mask };
+    bool val;
+
+    if (ioctl(lines_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v)) {
+        logmsg("Can't read the lines: %s\n", strerror(errno));
+        return;
+    }
+    val = v.bits >> line_index[LINE_POWER] & 1;
+    if (val != power_fault) {
+        logmsg("Missed an edge on the power fault line, catching up.\n");
+        power_changed(val, now);
+    }
+    if (line_offset[LINE_BATTERY_LOW] < 0) return;
+    val = v.bits >> line_index[LINE_BATTERY_LOW] & 1;
+    if (val != battery_low) {
+        logmsg("Missed an edge on the battery low line, catching up.\n");
+        battery_low_changed(val, now);
+    }
+}
+
+/* Run whatever has come due */
+static void timers_run(s64 now)
+{
+    struct hipi_ups_action a;
+
+    if (restore_at && now >= restore_at) {
+        restore_at = 0;
+        a = hipi_ups_restore_action(power_state);
+        act(&a, now);
+    }
+    if (shutdown_at && now >= shutdown_at) {
+        shutdown_at = 0;
+        if (!stopping) poweroff();
+    }
+    if (watchdog_at && now >= watchdog_at) {
+        watchdog_at = 0;
+        hipi_ups_heartbeat_set_raw(&heartbeat, false, now);
+        heartbeat_update(now);
+    }
+    if (heartbeat_at && now >= heartbeat_at) {
+        heartbeat_at = 0;
+        heartbeat_update(now);
+    }
+    if (status_at && now >= status_at) {
+        status_set(!status_level);
+        status_at = now + status_period_ms;
+    }
+    if (reconcile_at && now >= reconcile_at) {
+        lines_reconcile(now);
+        reconcile_at = now + RECONCILE_INTERVAL_MS;
+    }
+}
+
+/* ms until the next timer, -1 if none */
+static int timers_next(s64 now)
+{
+    s64 at[] = { restore_at, shutdown_at, watchdog_at, heartbeat_at, status_at, reconcile_at };
+    s64 next = 0;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(at) / sizeof(at[0]); i++)
+        if (at[i] && (!next || at[i] < next)) next = at[i];
+    if (!next) return -1;
+    return next > now ? (int)(next - now) : 0;
+}
+
+/* Handle one edge; now is in ns, for the latency */
+static void event_handle(int line, const struct gpio_v2_line_event *ev, s64 now)
+{
+    bool rising = ev->id == GPIO_V2_LINE_EVENT_RISING_EDGE;
+    unsigned long long latency_us;
+
+    switch (line) {
+    case LINE_POWER:
+        latency_us = (now - (s64)ev->timestamp_ns) / 1000;
+        latency_edges++;
+        latency_sum_us += latency_us;
+        if (latency_us > latency_max_us) latency_max_us = latency_us;
+        power_changed(rising, ev->timestamp_ns / 1000000);
+        break;
+    case LINE_ONLINE:
+        heartbeat_edge(ev->timestamp_ns / 1000000);
+        break;
+    case LINE_BATTERY_LOW:
+        battery_low_changed(rising, ev->timestamp_ns / 1000000);
+        break;
+    default:
+        break;
+    }
+}
+
+/* Handle the queued edges. Each edge's direction gives the level it left
+ * the line at; if the kernel dropped any, the levels are read back once the
+ * queue is empty.
+ */
+static void events_read(void)
+{
+    struct gpio_v2_line_event ev[EVENT_BATCH];
+    bool dropped = false;
+    ssize_t n, i;
+    s64 now;
+    int line;
+
+    do {
+        n = read(lines_fd, ev, sizeof(ev));
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) logmsg("Reading line events: %s\n", strerror(errno));
+            break;
+        }
+        now = now_ns();
+
+        for (i = 0; i < n / (ssize_t)sizeof(ev[0]); i++) {
+            for (line = 0; line < LINE_COUNT; line++)
+                if (line_offset[line] == (int)ev[i].offset) break;
+            if (line == LINE_COUNT) continue;
+
+            if (ev[i].line_seqno != line_seqno[line] + 1) dropped = true;
+            line_seqno[line] = ev[i].line_seqno;
+            event_handle(line, &ev[i], now);
+        }
+    } while (n == sizeof(ev));
+
+    if (dropped) lines_reconcile(now_ns() / 1000000);
+}
+
+static int chip_open(void)
+{
+    struct gpio_v2_line_request req = { 0 };
+    struct gpio_v2_line_values v = { 0 };
+    int fd, ret = 0, line;
+
+    fd = open(chip_path, O_RDWR | O_CLOEXEC);
+    if (fd < 0) return -errno;
+
+    /* Inputs in one request, so all their edges come through one fd */
+    strcpy(req.consumer, "hipi-ups-gpiod");
+    req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+    for (line = 0; line < LINE_COUNT; line++) {
+        if (line_offset[line] < 0) continue;
+        line_index[line] = req.num_lines;
+        req.offsets[req.num_lines++] = line_offset[line];
+    }
+    if (power_active_low) {
+        req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+        req.config.attrs[0].attr.flags = req.config.flags | GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+        req.config.attrs[0].mask = 1ULL << line_index[LINE_POWER];
+        req.config.num_attrs = 1;
+    }
+    if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req)) {
+        ret = -errno;
+        goto out;
+    }
+    lines_fd = req.fd;
+    fcntl(lines_fd, F_SETFL, O_NONBLOCK);
+
+    lines_mask = (1ULL << req.num_lines) - 1;
+    v.mask = lines_mask;
+    if (ioctl(lines_fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &v)) {
+        ret = -errno;
+        goto out;
+    }
+    power_fault = v.bits >> line_index[LINE_POWER] & 1;
+    if (line_offset[LINE_BATTERY_LOW] >= 0) battery_low = v.bits >> line_index[LINE_BATTERY_LOW] & 1;
+
+    if (status_offset >= 0) {
+        memset(&req, 0, sizeof(req));
+        strcpy(req.consumer, "hipi-ups-gpiod");
+        req.offsets[0] = status_offset;
+        req.num_lines = 1;
+        req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+        /* Low while running */
+        req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+        req.config.attrs[0].attr.values = 0;
+        req.config.attrs[0].mask = 1;
+        req.config.num_attrs = 1;
+        if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req)) {
+            ret = -errno;
+            goto out;
+        }
+        status_fd = req.fd;
+    }
+out:
+    close(fd);
+    return ret;
+}
+
+static void stats_print(void)
+{
+    struct timespec cpu;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu);
+    logmsg("power edges %llu latency avg %llu us max %llu us cpu %lld us\n", latency_edges,
+           latency_edges ? latency_sum_us / latency_edges : 0, latency_max_us,
+           (long long)cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000);
+}
+
+static void on_signal(int sig)
+{
+    if (sig == SIGUSR1) want_stats = 1;
+    else want_quit = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -p offset [options]\n"
+            "  -c, --chip               GPIO chip (default /dev/gpiochip0)\n"
+            "  -p, --power              Power fault line offset\n"
+            "  -A, --power-active-low   Power fault line reads low during a fault\n"
+            "  -o, --online             UPS heartbeat line offset\n"
+            "  -b, --battery-low        Battery-low line offset\n"
+            "  -s, --status             Status line offset\n"
+            "  -S, --status-period      Toggle the status line every this many ms\n"
+            "                           instead of holding it low\n"
+            "  -d, --shutdown-delay     ms on battery before powering off (default 60000)\n"
+            "  -t, --heartbeat-timeout  ms without a heartbeat edge before it's missing\n"
+            "                           (default 2000, 0 = don't watch)\n"
+            "  -r, --heartbeat-recover  ms the heartbeat must be back (default 2000)\n"
+            "  -R, --restore-stable     ms mains must be back to cancel (default 5000)\n"
+            "  -x, --shutdown-cmd       Run through sh to power off\n"
+            "                           (default \"systemctl poweroff\")\n"
+            "  -n, --dry-run            Log the shutdown instead of running it\n"
+            "SIGUSR1 prints power fault latency and CPU time.\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option opts[] = {
+        { "chip", required_argument, NULL, 'c' },
+        { "power", required_argument, NULL, 'p' },
+        { "power-active-low", no_argument, NULL, 'A' },
+        { "online", required_argument, NULL, 'o' },
+        { "battery-low", required_argument, NULL, 'b' },
+        { "status", required_argument, NULL, 's' },
+        { "status-period", required_argument, NULL, 'S' },
+        { "shutdown-delay", required_argument, NULL, 'd' },
+        { "heartbeat-timeout", required_argument, NULL, 't' },
+        { "heartbeat-recover", required_argument, NULL, 'r' },
+        { "restore-stable", required_argument, NULL, 'R' },
+        { "shutdown-cmd", required_argument, NULL, 'x' },
+        { "dry-run", no_argument, NULL, 'n' },
+        { "help", no_argument, NULL, 'h' },
+        { 0 }
+    };
+    struct pollfd pfd;
+    s64 now;
+    int opt, ret;
+
+    while ((opt = getopt_long(argc, argv, "c:p:Ao:b:s:S:d:t:r:R:x:nh", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'c': chip_path = optarg; break;
+        case 'p': line_offset[LINE_POWER] = atoi(optarg); break;
+        case 'A': power_active_low = true; break;
+        case 'o': line_offset[LINE_ONLINE] = atoi(optarg); break;
+        case 'b': line_offset[LINE_BATTERY_LOW] = atoi(optarg); break;
+        case 's': status_offset = atoi(optarg); break;
+        case 'S': status_period_ms = strtoul(optarg, NULL, 10); break;
+        case 'd': shutdown_delay_ms = strtoul(optarg, NULL, 10); break;
+        case 't': heartbeat_timeout_ms = strtoul(optarg, NULL, 10); break;
+        case 'r': heartbeat_recover_ms = strtoul(optarg, NULL, 10); break;
+        case 'R': restore_stable_ms = strtoul(optarg, NULL, 10); break;
+        case 'x': shutdown_cmd = optarg; break;
+        case 'n': dry_run = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (line_offset[LINE_POWER] < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!heartbeat_timeout_ms) line_offset[LINE_ONLINE] = -1;
+
+    ret = chip_open();
+    if (ret) {
+        logmsg("Can't request lines on %s: %s\n", chip_path, strerror(-ret));
+        return 1;
+    }
+
+    signal(SIGUSR1, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGINT, on_signal);
+    signal(SIGCHLD, SIG_IGN); /* Don't leave the shutdown command a zombie */
+
+    now = now_ns() / 1000000;
+    if (power_fault) {
+        logmsg("Started with power failure detected.\n");
+        power_state = HIPI_UPS_POWER_BATTERY;
+        schedule_shutdown(now, battery_low ? 0 : shutdown_delay_ms);
+    }
+    if (line_offset[LINE_ONLINE] >= 0)
+        watchdog_at = now + heartbeat_timeout_ms; /* Wait for the first toggle */
+    else
+        heartbeat_state = HIPI_UPS_HEARTBEAT_PRESENT; /* No heartbeat line: assume the UPS is there */
+    if (status_fd >= 0 && status_period_ms) status_at = now + status_period_ms;
+    reconcile_at = now + RECONCILE_INTERVAL_MS;
+
+    logmsg("Watching %s: power %d, online %d, battery-low %d, status %d\n", chip_path,
+           line_offset[LINE_POWER], line_offset[LINE_ONLINE], line_offset[LINE_BATTERY_LOW], status_offset);
+
+    pfd.fd = lines_fd;
+    pfd.events = POLLIN;
+    while (!want_quit) {
+        if (want_stats) {
+            want_stats = 0;
+            stats_print();
+        }
+        ret = poll(&pfd, 1, timers_next(now_ns() / 1000000));
+        if (ret < 0 && errno != EINTR) {
+            logmsg("poll: %s\n", strerror(errno));
+            return 1;
+        }
+        if (ret > 0) events_read();
+        timers_run(now_ns() / 1000000);
+    }
+
+    /* Like the driver across a poweroff, leave the status line as it is: a
+     * UPS told we're stopping may cut power before the filesystems are
+     * unmounted.
+     */
+    stats_print();
+    return 0;
+}
@@ -0,0 +1,41 @@
+/* Example shutdown policy for the hipi-ups driver.
+ *
+ * Build against the running kernel's BTF, which includes the driver's types
+ * once the module is loaded:
+ *
+ *   bpftool btf dump file /sys/kernel/btf/hipi_ups format c > vmlinux.h
+ *   clang -O2 -g -target bpf -c hipi-ups-policy.bpf.c -o hipi-ups-policy.bpf.o
+ *   sudo bpftool struct_ops register hipi-ups-policy.bpf.o /sys/fs/bpf/hipi-ups
+ *
+ * Remove the pinned link to detach it again.
+ */
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+char LICENSE[] SEC("license") = "Dual MIT/GPL";
+
+/* Nobody is around to fix things overnight: don't sit out the full delay */
+SEC("struct_ops/on_battery")
+s32 BPF_PROG(night_on_battery, const struct hipi_ups_policy_ctx *ctx)
+{
+    u32 hour = ((u64)ctx->realtime_s / 3600) % 24;
+
+    if (hour >= 22 || hour < 6) return ctx->default_ms / 4;
+    return ctx->default_ms;
+}
+
+/* The first outage in a while is likely a blip; give it one more minute */
+SEC("struct_ops/countdown_expired")
+s32 BPF_PROG(night_countdown_expired, const struct hipi_ups_policy_ctx *ctx)
+{
+    if (ctx->outages <= 1 && ctx->on_battery_ms < 120000) return 60000;
+    return 0;
+}
+
+SEC(".struct_ops.link")
+struct hipi_ups_ops night_policy = {
+    .on_battery = (void *)night_on_battery,
+    .countdown_expired = (void *)night_countdown_expired,
+    .name = "night",
+};
@@ -0,0 +1,80 @@
+#!/bin/sh
+# hipi-ups-probe-test: an instance that comes up already on battery with the
+# battery low is counted in the shutdown quorum.
+#
+# Needs root, configfs, gpio-sim and the hipi_ups module loaded with
+# CONFIG_HIPI_UPS_CONFIGFS and the default shutdown_quorum (all sources).
+# Brings up a "mains" instance on mains, then a "lowbat" instance with its
+# power fault and battery-low lines both asserted, whose countdown runs out
+# while it is still probing. With one of two sources down the driver must hold
+# the shutdown and say so, counting the new instance; it doesn't power off.
+#
+# Usage: sudo tools/hipi-ups-probe-test.sh
+set -e
+
+SIM=/sys/kernel/config/gpio-sim/hipi-ups-probe-test
+CFS=/sys/kernel/config/hipi-ups
+DRIVER=/sys/bus/platform/drivers/hipi_ups
+
+cleanup() {
+    for ups in lowbat mains; do
+        if [ -d "$CFS/$ups" ]; then
+            echo 0 > "$CFS/$ups/enable" 2>/dev/null || true
+            rmdir "$CFS/$ups"
+        fi
+    done
+    if [ -d "$SIM" ]; then
+        echo 0 > "$SIM/live"
+        rmdir "$SIM/bank0" "$SIM"
+    fi
+}
+trap cleanup EXIT
+
+fail() {
+    echo "FAIL: $*"
+    exit 1
+}
+
+# The device directory of the instance labelled $1
+ups_dir() {
+    for dir in "$DRIVER"/*/; do
+        [ "$(cat "$dir/label" 2>/dev/null)" = "$1" ] && echo "$dir" && return
+    done
+}
+
+# Bring up instance $1 on line $2, with battery-low on line $3 if given
+ups_add() {
+    mkdir "$CFS/$1"
+    echo gpio_ups > "$CFS/$1/board"
+    echo "hipi-ups-probe-test:$2" > "$CFS/$1/power_gpio"
+    [ -n "$3" ] && echo "hipi-ups-probe-test:$3" > "$CFS/$1/battery_low_gpio"
+    echo 3600000 > "$CFS/$1/shutdown_delay_ms"
+    echo 1 > "$CFS/$1/enable"
+    i=0
+    while [ -z "$(ups_dir "$1")" ]; do
+        i=$((i + 1))
+        [ "$i" -lt 50 ] || fail "$1 didn't bind"
+        sleep 0.1
+    done
+}
+
+modprobe gpio-sim
+mkdir "$SIM" "$SIM/bank0"
+echo 3 > "$SIM/bank0/num_lines"
+echo hipi-ups-probe-test > "$SIM/bank0/label"
+echo 1 > "$SIM/live"
+LINES=/sys/devices/platform/$(cat "$SIM/dev_name")/$(cat "$SIM/bank0/chip_name")
+
+ups_add mains 0
+# Power fault and battery low asserted before the instance exists
+echo pull-up > "$LINES/sim_gpio1/pull"
+echo pull-up > "$LINES/sim_gpio2/pull"
+ups_add lowbat 1 2
+sleep 1
+
+LOWBAT=$(ups_dir lowbat)
+[ "$(cat "$LOWBAT/power_state")" = battery ] || fail "lowbat isn't on battery"
+[ "$(cat "$LOWBAT/battery_low")" = 1 ] || fail "lowbat's battery isn't low"
+[ "$(cat "$LOWBAT/stats/shutdowns_held")" = 1 ] || fail "lowbat's shutdown wasn't held by the quorum"
+dmesg | tail -n 50 | grep -q "only 1 of 2 UPS sources are down" || fail "the hold didn't count both sources"
+echo PASS
@@ -0,0 +1,366 @@
+/* hipi-ups.hpp: header-only C++20 client for the hipi-ups driver.
+ *
+ * Follows the state of every hipi-ups instance through the driver's sysfs
+ * attributes, which notify poll()ers on change (see the driver's
+ * notify_work_handler()). Nothing is sampled on a timer.
+ *
+ *   hipi_ups::monitor mon;               // Every instance under /sys
+ *
+ *   // Batch reads, e.g. from your own epoll loop on mon.fd()
+ *   for (const hipi_ups::event &ev : mon.read(-1))
+ *       ...;
+ *
+ *   // Or from a coroutine, with mon.dispatch() driving the loop
+ *   hipi_ups::task watch(hipi_ups::monitor &mon)
+ *   {
+ *       for (;;) {
+ *           hipi_ups::event ev = co_await mon.next_event();
+ *           ...
+ *       }
+ *   }
+ *
+ * Like tools/hipi-upsd, the attributes are also watched with inotify so a
+ * plain-file tree under another sysfs root works for testing.
+ */
+#ifndef HIPI_UPS_HPP
+#define HIPI_UPS_HPP
+
+#include <array>
+#include <cerrno>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace hipi_ups {
+
+/* Attributes that notify on change */
+enum class attr : unsigned {
+    power_state,
+    heartbeat_state,
+    ups_online,
+    battery_low,
+    charging,
+    count,
+};
+
+inline constexpr std::array<const char *, static_cast<unsigned>(attr::count)> attr_names = {
+    "power_state", "heartbeat_state", "ups_online", "battery_low", "charging",
+};
+
+/* Same order as the driver's enums */
+enum class power_state : int { unknown = -1, mains, battery, restoring };
+enum class heartbeat_state : int { unknown, present, missing, flapping };
+
+/* One attribute changing value. Values are parsed as they're read, so an
+ * event is a few words that can be copied around freely.
+ */
+struct event {
+    unsigned ups;  /* Index into monitor::upses() */
+    attr which;
+    int value;     /* power_state, heartbeat_state or 0/1, see the accessors */
+    std::chrono::steady_clock::time_point when; /* When the change was read */
+
+    power_state power() const noexcept { return static_cast<power_state>(value); }
+    hipi_ups::heartbeat_state heartbeat() const noexcept { return static_cast<hipi_ups::heartbeat_state>(value); }
+    bool flag() const noexcept { return value > 0; }
+};
+
+struct ups_info {
+    std::string name; /* The instance label */
+    std::string dir;  /* Device directory holding the attributes */
+};
+
+/* An owned file descriptor */
+class fd_handle {
+public:
+    fd_handle() noexcept = default;
+    explicit fd_handle(int fd) noexcept : fd_(fd) { }
+    fd_handle(fd_handle &&other) noexcept : fd_(std::exchange(other.fd_, -1)) { }
+    fd_handle &operator=(fd_handle &&other) noexcept
+    {
+        if (this != &other) reset(std::exchange(other.fd_, -1));
+        return *this;
+    }
+    fd_handle(const fd_handle &) = delete;
+    fd_handle &operator=(const fd_handle &) = delete;
+    ~fd_handle() { reset(); }
+
+    int get() const noexcept { return fd_; }
+    explicit operator bool() const noexcept { return fd_ >= 0; }
+    void reset(int fd = -1) noexcept
+    {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = fd;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+namespace detail {
+
+[[noreturn]] inline void throw_errno(const char *what, int err = errno)
+{
+    throw std::system_error(err, std::generic_category(), what);
+}
+
+/* Read an attribute without the trailing newline. Uses pread so the fd stays
+ * armed for POLLPRI.
+ */
+inline std::string_view read_fd(int fd, std::span<char> buf)
+{
+    ssize_t n = ::pread(fd, buf.data(), buf.size(), 0);
+
+    if (n < 0) return { };
+    while (n && (buf[n - 1] == '\n' || buf[n - 1] == ' ')) n--;
+    return { buf.data(), static_cast<size_t>(n) };
+}
+
+inline int parse(attr which, std::string_view text)
+{
+    static constexpr std::array<std::string_view, 3> power = { "mains", "battery", "restoring" };
+    static constexpr std::array<std::string_view, 4> heartbeat = { "unknown", "present", "missing", "flapping" };
+
+    switch (which) {
+    case attr::power_state:
+        for (size_t i = 0; i < power.size(); i++)
+            if (text == power[i]) return static_cast<int>(i);
+        return static_cast<int>(power_state::unknown);
+    case attr::heartbeat_state:
+        for (size_t i = 0; i < heartbeat.size(); i++)
+            if (text == heartbeat[i]) return static_cast<int>(i);
+        return static_cast<int>(heartbeat_state::unknown);
+    default:
+        return text == "1";
+    }
+}
+
+} /* namespace detail */
+
+/* A fire-and-forget coroutine: starts right away and frees itself when done */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return { }; }
+        std::suspend_never initial_suspend() noexcept { return { }; }
+        std::suspend_never final_suspend() noexcept { return { }; }
+        void return_void() noexcept { }
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+class monitor {
+    static constexpr unsigned nattrs = static_cast<unsigned>(attr::count);
+    static constexpr uint64_t inotify_tag = UINT64_MAX;
+    static constexpr size_t batch_max = 64;
+
+    struct slot {
+        fd_handle fd;
+        int wd = -1;   /* inotify watch */
+        int value = -1;
+    };
+
+public:
+    class event_awaiter;
+
+    /* Find the driver's instances under <sysfs_root>/bus/platform/drivers/hipi_ups.
+     * Throws std::system_error, with ENODEV if there are none.
+     */
+    explicit monitor(std::string_view sysfs_root = "/sys")
+        : epoll_(::epoll_create1(EPOLL_CLOEXEC)), inotify_(::inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+    {
+        std::string drv = std::string(sysfs_root) + "/bus/platform/drivers/hipi_ups";
+        std::array<char, 64> buf;
+        struct epoll_event ev = { };
+        dirent *de;
+        DIR *d;
+
+        if (!epoll_) detail::throw_errno("epoll_create1");
+        if (!inotify_) detail::throw_errno("inotify_init1");
+
+        d = ::opendir(drv.c_str());
+        if (!d) detail::throw_errno(drv.c_str());
+        while ((de = ::readdir(d))) {
+            if (de->d_name[0] == '.') continue;
+            ups_info info{ { }, drv + "/" + de->d_name };
+            fd_handle label(::open((info.dir + "/label").c_str(), O_RDONLY | O_CLOEXEC));
+            if (!label) continue;
+            info.name = detail::read_fd(label.get(), buf);
+            upses_.push_back(std::move(info));
+        }
+        ::closedir(d);
+        if (upses_.empty()) detail::throw_errno(drv.c_str(), ENODEV);
+
+        slots_ = std::vector<slot>(upses_.size() * nattrs);
+        for (size_t i = 0; i < slots_.size(); i++) {
+            std::string path = upses_[i / nattrs].dir + "/" + attr_names[i % nattrs];
+            slot &s = slots_[i];
+
+            s.fd.reset(::open(path.c_str(), O_RDONLY | O_CLOEXEC));
+            if (!s.fd) continue; /* Older driver without this attribute */
+            s.value = detail::parse(static_cast<attr>(i % nattrs), detail::read_fd(s.fd.get(), buf));
+            ev.events = EPOLLPRI;
+            ev.data.u64 = i;
+            /* Plain files can't be epolled, inotify covers those */
+            if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, s.fd.get(), &ev) && errno != EPERM)
+                detail::throw_errno("epoll_ctl");
+            s.wd = ::inotify_add_watch(inotify_.get(), path.c_str(), IN_MODIFY | IN_CLOSE_WRITE);
+        }
+        ev.events = EPOLLIN;
+        ev.data.u64 = inotify_tag;
+        if (::epoll_ctl(epoll_.get(), EPOLL_CTL_ADD, inotify_.get(), &ev)) detail::throw_errno("epoll_ctl");
+    }
+
+    monitor(const monitor &) = delete;
+    monitor &operator=(const monitor &) = delete;
+
+    /* Coroutines still waiting for an event are destroyed with the monitor */
+    ~monitor()
+    {
+        for (event_awaiter *w : waiters_) w->handle_.destroy();
+    }
+
+    /* Readable when read() has something to look at; add it to your own
+     * epoll set or event loop.
+     */
+    int fd() const noexcept { return epoll_.get(); }
+
+    const std::vector<ups_info> &upses() const noexcept { return upses_; }
+
+    /* Last value read, -1 if the attribute is missing */
+    int value(unsigned ups, attr which) const noexcept
+    {
+        return slots_[ups * nattrs + static_cast<unsigned>(which)].value;
+    }
+
+    /* Wait up to timeout_ms (-1 forever, 0 not at all) for changes and return
+     * them. The span points into the monitor and is valid until the next call;
+     * nothing is allocated once it has grown to the largest batch seen.
+     */
+    std::span<const event> read(int timeout_ms = 0)
+    {
+        std::array<struct epoll_event, batch_max> evs;
+        int n;
+
+        batch_.clear();
+        do {
+            n = ::epoll_wait(epoll_.get(), evs.data(), evs.size(), timeout_ms);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) detail::throw_errno("epoll_wait");
+
+        auto now = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++) {
+            if (evs[i].data.u64 == inotify_tag)
+                read_inotify(now);
+            else
+                refresh(evs[i].data.u64, now);
+        }
+        return batch_;
+    }
+
+    /* co_await mon.next_event() resumes with the next change. Events that
+     * arrive with no coroutine waiting are queued for the next one.
+     */
+    class event_awaiter {
+    public:
+        explicit event_awaiter(monitor &mon) noexcept : mon_(mon) { }
+
+        bool await_ready() noexcept
+        {
+            if (mon_.pending_.empty()) return false;
+            ev_ = mon_.pending_.front();
+            mon_.pending_.pop_front();
+            return true;
+        }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            handle_ = handle;
+            mon_.waiters_.push_back(this);
+        }
+        event await_resume() const noexcept { return ev_; }
+
+    private:
+        friend class monitor;
+        monitor &mon_;
+        std::coroutine_handle<> handle_;
+        event ev_{ };
+    };
+
+    event_awaiter next_event() noexcept { return event_awaiter(*this); }
+
+    /* Read changes, waiting up to timeout_ms, and resume the coroutines
+     * waiting in next_event(). Returns the number of changes read.
+     */
+    size_t dispatch(int timeout_ms = -1)
+    {
+        std::span<const event> evs = read(timeout_ms);
+
+        pending_.insert(pending_.end(), evs.begin(), evs.end());
+        while (!waiters_.empty() && !pending_.empty()) {
+            event_awaiter *w = waiters_.front();
+
+            waiters_.pop_front();
+            w->ev_ = pending_.front();
+            pending_.pop_front();
+            w->handle_.resume(); /* May wait again before returning */
+        }
+        return evs.size();
+    }
+
+private:
+    void refresh(size_t i, std::chrono::steady_clock::time_point now)
+    {
+        std::array<char, 32> buf;
+        slot &s = slots_[i];
+        attr which = static_cast<attr>(i % nattrs);
+        int value;
+
+        if (!s.fd) return;
+        value = detail::parse(which, detail::read_fd(s.fd.get(), buf));
+        if (value == s.value) return;
+        s.value = value;
+        batch_.push_back({ static_cast<unsigned>(i / nattrs), which, value, now });
+    }
+
+    void read_inotify(std::chrono::steady_clock::time_point now)
+    {
+        alignas(struct inotify_event) std::array<char, 4096> buf;
+        ssize_t n;
+
+        while ((n = ::read(inotify_.get(), buf.data(), buf.size())) > 0) {
+            for (ssize_t off = 0; off < n;) {
+                const auto *ie = reinterpret_cast<const struct inotify_event *>(buf.data() + off);
+
+                for (size_t i = 0; i < slots_.size(); i++)
+                    if (slots_[i].wd == ie->wd) refresh(i, now);
+                off += sizeof(*ie) + ie->len;
+            }
+        }
+    }
+
+    fd_handle epoll_;
+    fd_handle inotify_;
+    std::vector<ups_info> upses_;
+    std::vector<slot> slots_;   /* nattrs per instance */
+    std::vector<event> batch_;  /* Backs the span read() returns */
+    std::deque<event> pending_;
+    std::deque<event_awaiter *> waiters_;
+};
+
+} /* namespace hipi_ups */
+
+#endif /* HIPI_UPS_HPP */
@@ -0,0 +1,702 @@
+/* hipi-upsd: serve hipi-ups state to NUT clients.
+ *
+ * A minimal upsd speaking the Network UPS Tools protocol, so upsmon on other
+ * hosts behind the same UPS can follow this one. State comes from the
+ * driver's sysfs attributes, which are poll()ed for change notifications
+ * (and watched with inotify, so a plain-file tree under --sysfs-root works for
+ * testing); nothing is sampled on a timer. Instances bound or unbound later,
+ * e.g. through configfs, are picked up from the driver core's uevents.
+ *
+ * Build: make -C tools
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/netlink.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_UPS 16
+#define MAX_LISTENERS 4
+#define MAX_CLIENTS 64
+#define LINE_MAX_LEN 512
+
+/* Attributes that notify on change, see the driver's notify_work_handler() */
+enum attr {
+    ATTR_POWER_STATE,
+    ATTR_UPS_ONLINE,
+    ATTR_BATTERY_LOW,
+    ATTR_CHARGING,
+    ATTR_COUNT,
+};
+
+static const char *const attr_names[ATTR_COUNT] = {
+    [ATTR_POWER_STATE] = "power_state",
+    [ATTR_UPS_ONLINE] = "ups_online",
+    [ATTR_BATTERY_LOW] = "battery_low",
+    [ATTR_CHARGING] = "charging",
+};
+
+struct ups {
+    char name[64];          /* The instance label, also the NUT UPS name */
+    char dir[PATH_MAX];     /* Device directory holding the attributes */
+    int fd[ATTR_COUNT];
+    int wd[ATTR_COUNT];     /* inotify watches */
+    char value[ATTR_COUNT][32];
+};
+
+struct client {
+    int fd;
+    char buf[LINE_MAX_LEN];
+    size_t len;
+    char login[64];         /* UPS logged into, empty if none */
+};
+
+static char driver_dir[PATH_MAX - NAME_MAX - 1]; /* <root>/bus/platform/drivers/hipi_ups */
+
+static struct ups ups[MAX_UPS];
+static unsigned int nups;
+static struct client clients[MAX_CLIENTS];
+static int listeners[MAX_LISTENERS];
+static unsigned int nlisteners;
+static int inotify_fd = -1;
+static int driver_wd = -1; /* inotify watch on driver_dir */
+static int uevent_fd = -1;
+
+static const char *sysfs_root = "/sys";
+static const char *listen_addr = "127.0.0.1";
+static const char *listen_port = "3493";
+static int fsd_lead_s = 10;
+static bool verbose;
+
+static void logmsg(const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/* Read a sysfs attribute into buf without the trailing newline. Uses pread so
+ * the fd stays armed for POLLPRI.
+ */
+static int read_attr_fd(int fd, char *buf, size_t size)
+{
+    ssize_t n = pread(fd, buf, size - 1, 0);
+
+    if (n < 0) return -errno;
+    while (n && (buf[n - 1] == '\n' || buf[n - 1] == ' ')) n--;
+    buf[n] = '\0';
+    return 0;
+}
+
+static int read_attr(const char *dir, const char *attr, char *buf, size_t size)
+{
+    char path[PATH_MAX];
+    int fd, ret;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, attr);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -errno;
+    ret = read_attr_fd(fd, buf, size);
+    close(fd);
+    return ret;
+}
+
+static void ups_refresh(struct ups *u, bool announce)
+{
+    char old[32];
+    int i;
+
+    for (i = 0; i < ATTR_COUNT; i++) {
+        if (u->fd[i] < 0) continue;
+        strcpy(old, u->value[i]);
+        if (read_attr_fd(u->fd[i], u->value[i], sizeof(u->value[i]))) continue;
+        if (announce && strcmp(old, u->value[i]))
+            logmsg("%s: %s %s -> %s\n", u->name, attr_names[i], old, u->value[i]);
+    }
+}
+
+static void ups_close(struct ups *u)
+{
+    int i;
+
+    for (i = 0; i < ATTR_COUNT; i++) {
+        if (u->fd[i] >= 0) close(u->fd[i]);
+        if (u->wd[i] >= 0) inotify_rm_watch(inotify_fd, u->wd[i]);
+    }
+}
+
+static struct ups *ups_find_dir(const char *dir)
+{
+    unsigned int i;
+
+    for (i = 0; i < nups; i++)
+        if (!strcmp(ups[i].dir, dir)) return &ups[i];
+    return NULL;
+}
+
+static bool ups_open(struct ups *u, const char *dir)
+{
+    char path[PATH_MAX];
+    int i;
+
+    snprintf(u->dir, sizeof(u->dir), "%s", dir);
+    if (read_attr(u->dir, "label", u->name, sizeof(u->name))) return false;
+
+    for (i = 0; i < ATTR_COUNT; i++) {
+        snprintf(path, sizeof(path), "%s/%s", u->dir, attr_names[i]);
+        u->fd[i] = open(path, O_RDONLY | O_CLOEXEC);
+        u->wd[i] = inotify_add_watch(inotify_fd, path, IN_MODIFY | IN_CLOSE_WRITE);
+        u->value[i][0] = '\0';
+    }
+    ups_refresh(u, false);
+    return true;
+}
+
+/* Bring the instances under <root>/bus/platform/drivers/hipi_ups up to date:
+ * open the ones bound since the last scan and drop the ones unbound.
+ */
+static int ups_scan(void)
+{
+    bool seen[MAX_UPS] = { false };
+    char path[PATH_MAX];
+    struct dirent *de;
+    struct ups *u;
+    unsigned int i;
+    DIR *d;
+
+    d = opendir(driver_dir);
+    if (d) {
+        while ((de = readdir(d))) {
+            if (de->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "%s/%s", driver_dir, de->d_name);
+            u = ups_find_dir(path);
+            if (u) {
+                seen[u - ups] = true;
+                continue;
+            }
+            if (nups == MAX_UPS || !ups_open(&ups[nups], path)) continue;
+            logmsg("Serving %s from %s\n", ups[nups].name, ups[nups].dir);
+            seen[nups++] = true;
+        }
+        closedir(d);
+    }
+
+    for (i = nups; i-- > 0;) {
+        if (seen[i]) continue;
+        logmsg("No longer serving %s\n", ups[i].name);
+        ups_close(&ups[i]);
+        memmove(&ups[i], &ups[i + 1], (nups - i - 1) * sizeof(ups[0]));
+        memmove(&seen[i], &seen[i + 1], (nups - i - 1) * sizeof(seen[0]));
+        nups--;
+    }
+    return d ? 0 : -errno;
+}
+
+static struct ups *ups_find(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < nups; i++)
+        if (!strcmp(ups[i].name, name)) return &ups[i];
+    return NULL;
+}
+
+/* A time attribute in ms, rounded up to s, or -1 */
+static long ups_seconds(struct ups *u, const char *attr)
+{
+    char buf[32];
+    long ms;
+
+    if (read_attr(u->dir, attr, buf, sizeof(buf))) return -1;
+    ms = strtol(buf, NULL, 10);
+    return ms < 0 ? -1 : (ms + 999) / 1000;
+}
+
+/* Seconds until the driver's shutdown countdown runs out, -1 if none */
+static long ups_runtime(struct ups *u)
+{
+    return ups_seconds(u, "shutdown_remaining_ms");
+}
+
+/* Seconds until the driver powers the host off, -1 if it won't */
+static long ups_poweroff(struct ups *u)
+{
+    return ups_seconds(u, "poweroff_remaining_ms");
+}
+
+static bool attr_true(struct ups *u, enum attr a)
+{
+    return !strcmp(u->value[a], "1");
+}
+
+static void ups_status(struct ups *u, char *buf, size_t size)
+{
+    long poweroff = ups_poweroff(u);
+
+    snprintf(buf, size, "%s%s%s%s%s",
+             strcmp(u->value[ATTR_POWER_STATE], "mains") ? "OB" : "OL",
+             attr_true(u, ATTR_BATTERY_LOW) ? " LB" : "",
+             attr_true(u, ATTR_CHARGING) ? " CHRG" : "",
+             u->fd[ATTR_UPS_ONLINE] >= 0 && !attr_true(u, ATTR_UPS_ONLINE) ? " ALARM" : "",
+             /* Let secondaries start their shutdown just ahead of ours */
+             poweroff >= 0 && poweroff <= fsd_lead_s ? " FSD" : "");
+}
+
+/* Variables served per UPS. get() returns false if the variable has no
+ * value right now.
+ */
+struct var {
+    const char *name;
+    bool (*get)(struct ups *u, char *buf, size_t size);
+};
+
+static bool var_status(struct ups *u, char *buf, size_t size)
+{
+    ups_status(u, buf, size);
+    return true;
+}
+
+static bool var_runtime(struct ups *u, char *buf, size_t size)
+{
+    long runtime = ups_runtime(u);
+
+    if (runtime < 0) return false;
+    snprintf(buf, size, "%ld", runtime);
+    return true;
+}
+
+static bool var_charger(struct ups *u, char *buf, size_t size)
+{
+    if (u->fd[ATTR_CHARGING] < 0) return false;
+    snprintf(buf, size, "%s", attr_true(u, ATTR_CHARGING) ? "charging" : "resting");
+    return true;
+}
+
+static bool var_alarm(struct ups *u, char *buf, size_t size)
+{
+    if (u->fd[ATTR_UPS_ONLINE] < 0 || attr_true(u, ATTR_UPS_ONLINE)) return false;
+    snprintf(buf, size, "UPS heartbeat missing");
+    return true;
+}
+
+static bool var_device_type(struct ups *u, char *buf, size_t size)
+{
+    snprintf(buf, size, "ups");
+    return true;
+}
+
+static bool var_driver_name(struct ups *u, char *buf, size_t size)
+{
+    snprintf(buf, size, "hipi-ups");
+    return true;
+}
+
+static const struct var vars[] = {
+    { "battery.charger.status", var_charger },
+    { "battery.runtime", var_runtime },
+    { "device.type", var_device_type },
+    { "driver.name", var_driver_name },
+    { "ups.alarm", var_alarm },
+    { "ups.status", var_status },
+};
+
+static void client_send(struct client *c, const char *fmt, ...)
+{
+    char buf[LINE_MAX_LEN];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    if (n > (int)sizeof(buf) - 1) n = sizeof(buf) - 1;
+    /* Replies are short; a client that can't take them gets dropped */
+    if (send(c->fd, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT) != n) shutdown(c->fd, SHUT_RDWR);
+}
+
+static void client_close(struct client *c)
+{
+    close(c->fd);
+    c->fd = -1;
+}
+
+/* Split a request into words, honouring "quoted strings" */
+static int split(char *line, char **argv, int max)
+{
+    int argc = 0;
+    char *p = line;
+
+    while (*p && argc < max) {
+        while (*p == ' ' || *p == '\t') p++;
+        if (!*p) break;
+        if (*p == '"') {
+            argv[argc++] = ++p;
+            while (*p && *p != '"') {
+                if (*p == '\\' && p[1]) memmove(p, p + 1, strlen(p));
+                p++;
+            }
+        } else {
+            argv[argc++] = p;
+            while (*p && *p != ' ' && *p != '\t') p++;
+        }
+        if (*p) *p++ = '\0';
+    }
+    return argc;
+}
+
+static unsigned int numlogins(const char *name)
+{
+    unsigned int i, n = 0;
+
+    for (i = 0; i < MAX_CLIENTS; i++)
+        if (clients[i].fd >= 0 && !strcmp(clients[i].login, name)) n++;
+    return n;
+}
+
+static void cmd_list(struct client *c, int argc, char **argv)
+{
+    char val[128];
+    struct ups *u;
+    unsigned int i;
+
+    if (argc == 2 && !strcmp(argv[1], "UPS")) {
+        client_send(c, "BEGIN LIST UPS\n");
+        for (i = 0; i < nups; i++) client_send(c, "UPS %s \"hipi-ups\"\n", ups[i].name);
+        client_send(c, "END LIST UPS\n");
+        return;
+    }
+    if (argc != 3) {
+        client_send(c, "ERR INVALID-ARGUMENT\n");
+        return;
+    }
+    u = ups_find(argv[2]);
+    if (!u) {
+        client_send(c, "ERR UNKNOWN-UPS\n");
+        return;
+    }
+    if (!strcmp(argv[1], "VAR")) {
+        client_send(c, "BEGIN LIST VAR %s\n", u->name);
+        for (i = 0; i < sizeof(vars) / sizeof(vars[0]); i++)
+            if (vars[i].get(u, val, sizeof(val))) client_send(c, "VAR %s %s \"%s\"\n", u->name, vars[i].name, val);
+        client_send(c, "END LIST VAR %s\n", u->name);
+    } else if (!strcmp(argv[1], "RW") || !strcmp(argv[1], "CMD") || !strcmp(argv[1], "CLIENT")) {
+        /* Read-only server: nothing to set, no commands */
+        client_send(c, "BEGIN LIST %s %s\nEND LIST %s %s\n", argv[1], u->name, argv[1], u->name);
+    } else {
+        client_send(c, "ERR INVALID-ARGUMENT\n");
+    }
+}
+
+static void cmd_get(struct client *c, int argc, char **argv)
+{
+    char val[128];
+    struct ups *u;
+    unsigned int i;
+
+    if (argc < 3) {
+        client_send(c, "ERR INVALID-ARGUMENT\n");
+        return;
+    }
+    u = ups_find(argv[2]);
+    if (!u) {
+        client_send(c, "ERR UNKNOWN-UPS\n");
+        return;
+    }
+    if (!strcmp(argv[1], "NUMLOGINS")) {
+        client_send(c, "NUMLOGINS %s %u\n", u->name, numlogins(u->name));
+    } else if (!strcmp(argv[1], "UPSDESC")) {
+        client_send(c, "UPSDESC %s \"hipi-ups\"\n", u->name);
+    } else if (!strcmp(argv[1], "VAR") && argc == 4) {
+        for (i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+            if (strcmp(vars[i].name, argv[3])) continue;
+            if (vars[i].get(u, val, sizeof(val))) client_send(c, "VAR %s %s \"%s\"\n", u->name, argv[3], val);
+            else client_send(c, "ERR DATA-STALE\n");
+            return;
+        }
+        client_send(c, "ERR VAR-NOT-SUPPORTED\n");
+    } else {
+        client_send(c, "ERR INVALID-ARGUMENT\n");
+    }
+}
+
+static void client_command(struct client *c, char *line)
+{
+    char *argv[8];
+    int argc = split(line, argv, 8);
+
+    if (!argc) return;
+    if (verbose) logmsg("fd %d: %s\n", c->fd, argv[0]);
+
+    if (!strcmp(argv[0], "LIST")) {
+        cmd_list(c, argc, argv);
+    } else if (!strcmp(argv[0], "GET")) {
+        cmd_get(c, argc, argv);
+    } else if (!strcmp(argv[0], "VER")) {
+        client_send(c, "hipi-upsd (NUT network protocol 1.3)\n");
+    } else if (!strcmp(argv[0], "NETVER")) {
+        client_send(c, "1.3\n");
+    } else if (!strcmp(argv[0], "HELP")) {
+        client_send(c, "Commands: HELP VER NETVER GET LIST USERNAME PASSWORD LOGIN LOGOUT PRIMARY MASTER\n");
+    } else if (!strcmp(argv[0], "USERNAME") || !strcmp(argv[0], "PASSWORD")) {
+        /* No accounts: access is controlled by where we listen */
+        client_send(c, "OK\n");
+    } else if (!strcmp(argv[0], "LOGIN")) {
+        if (argc != 2 || !ups_find(argv[1])) {
+            client_send(c, "ERR UNKNOWN-UPS\n");
+            return;
+        }
+        snprintf(c->login, sizeof(c->login), "%s", argv[1]);
+        client_send(c, "OK\n");
+    } else if (!strcmp(argv[0], "PRIMARY") || !strcmp(argv[0], "MASTER")) {
+        client_send(c, "OK %s-GRANTED\n", argv[0]);
+    } else if (!strcmp(argv[0], "LOGOUT")) {
+        client_send(c, "OK Goodbye\n");
+        client_close(c);
+    } else if (!strcmp(argv[0], "STARTTLS")) {
+        client_send(c, "ERR FEATURE-NOT-CONFIGURED\n");
+    } else if (!strcmp(argv[0], "FSD") || !strcmp(argv[0], "SET") || !strcmp(argv[0], "INSTCMD")) {
+        /* The driver decides when to shut down */
+        client_send(c, "ERR ACCESS-DENIED\n");
+    } else {
+        client_send(c, "ERR UNKNOWN-COMMAND\n");
+    }
+}
+
+static void client_read(struct client *c)
+{
+    ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, 0);
+    char *line, *nl;
+
+    if (n <= 0) {
+        client_close(c);
+        return;
+    }
+    c->len += n;
+    c->buf[c->len] = '\0';
+
+    line = c->buf;
+    while (c->fd >= 0 && (nl = strchr(line, '\n'))) {
+        *nl = '\0';
+        if (nl > line && nl[-1] == '\r') nl[-1] = '\0';
+        client_command(c, line);
+        line = nl + 1;
+    }
+    if (c->fd < 0) return;
+
+    c->len -= line - c->buf;
+    memmove(c->buf, line, c->len);
+    if (c->len == sizeof(c->buf) - 1) {
+        client_send(c, "ERR INVALID-ARGUMENT\n");
+        client_close(c);
+    }
+}
+
+static void client_accept(int lfd)
+{
+    int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+    unsigned int i;
+
+    if (fd < 0) return;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd >= 0) continue;
+        clients[i].fd = fd;
+        clients[i].len = 0;
+        clients[i].login[0] = '\0';
+        return;
+    }
+    close(fd);
+}
+
+static int listen_open(void)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_PASSIVE };
+    struct addrinfo *res, *ai;
+    int fd, one = 1, ret;
+
+    ret = getaddrinfo(listen_addr, listen_port, &hints, &res);
+    if (ret) {
+        logmsg("%s:%s: %s\n", listen_addr, listen_port, gai_strerror(ret));
+        return -EINVAL;
+    }
+    for (ai = res; ai && nlisteners < MAX_LISTENERS; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, 16)) {
+            close(fd);
+            continue;
+        }
+        listeners[nlisteners++] = fd;
+    }
+    freeaddrinfo(res);
+    return nlisteners ? 0 : -EADDRNOTAVAIL;
+}
+
+/* A change somewhere: re-read everything, there's little enough of it.
+ * Entries coming and going in a plain-file driver directory stand in for
+ * bind and unbind uevents.
+ */
+static void ups_changed(void)
+{
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    bool rescan = false;
+    unsigned int i;
+    ssize_t n;
+    char *p;
+
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0)
+        for (p = buf; p < buf + n; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->wd == driver_wd) rescan = true;
+        }
+    if (rescan) ups_scan();
+    for (i = 0; i < nups; i++) ups_refresh(&ups[i], true);
+}
+
+/* Listen for the driver core's bind and unbind uevents */
+static void uevent_open(void)
+{
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+
+    uevent_fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    if (uevent_fd < 0) return;
+    if (bind(uevent_fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        close(uevent_fd);
+        uevent_fd = -1;
+    }
+}
+
+/* Rescan when a platform device is bound or unbound. The unbind uevent no
+ * longer names the driver, so any platform device counts.
+ */
+static void uevent_read(void)
+{
+    char buf[4096];
+    bool rescan = false;
+    ssize_t n;
+
+    while ((n = recv(uevent_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+        buf[n] = '\0';
+        if ((!strncmp(buf, "bind@", 5) || !strncmp(buf, "unbind@", 7)) && strstr(buf, "@/devices/platform/"))
+            rescan = true;
+    }
+    if (rescan) ups_scan();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-l addr] [-p port] [-r sysfs-root] [-f fsd-lead-s] [-v]\n"
+            "  -l, --listen      Address to listen on (default 127.0.0.1)\n"
+            "  -p, --port        Port to listen on (default 3493)\n"
+            "  -r, --sysfs-root  Where sysfs is mounted (default /sys)\n"
+            "  -f, --fsd-lead    Report FSD this many seconds before the driver\n"
+            "                    shuts down (default 10)\n"
+            "  -v, --verbose     Log client commands\n",
+            prog);
+}
+
+int main(int argc, char **argv)
+{
+    static const struct option opts[] = {
+        { "listen", required_argument, NULL, 'l' },
+        { "port", required_argument, NULL, 'p' },
+        { "sysfs-root", required_argument, NULL, 'r' },
+        { "fsd-lead", required_argument, NULL, 'f' },
+        { "verbose", no_argument, NULL, 'v' },
+        { "help", no_argument, NULL, 'h' },
+        { 0 }
+    };
+    struct pollfd pfd[MAX_LISTENERS + 2 + MAX_UPS * ATTR_COUNT + MAX_CLIENTS];
+    struct client *owner[sizeof(pfd) / sizeof(pfd[0])];
+    unsigned int i, j, n, nattr, uevent_idx;
+    int opt, ret;
+
+    while ((opt = getopt_long(argc, argv, "l:p:r:f:vh", opts, NULL)) != -1) {
+        switch (opt) {
+        case 'l': listen_addr = optarg; break;
+        case 'p': listen_port = optarg; break;
+        case 'r': sysfs_root = optarg; break;
+        case 'f': fsd_lead_s = atoi(optarg); break;
+        case 'v': verbose = true; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+
+    for (i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    uevent_open();
+    snprintf(driver_dir, sizeof(driver_dir), "%s/bus/platform/drivers/hipi_ups", sysfs_root);
+    driver_wd = inotify_add_watch(inotify_fd, driver_dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+    ret = ups_scan();
+    if (ret) {
+        logmsg("No hipi-ups driver under %s: %s\n", sysfs_root, strerror(-ret));
+        return 1;
+    }
+    if (!nups) logmsg("No hipi-ups instances yet, waiting for one to be bound\n");
+    ret = listen_open();
+    if (ret) {
+        logmsg("Can't listen on %s:%s: %s\n", listen_addr, listen_port, strerror(-ret));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    for (;;) {
+        n = 0;
+        for (i = 0; i < nlisteners; i++) {
+            owner[n] = NULL;
+            pfd[n++] = (struct pollfd){ .fd = listeners[i], .events = POLLIN };
+        }
+        owner[n] = NULL;
+        uevent_idx = n;
+        pfd[n++] = (struct pollfd){ .fd = uevent_fd, .events = POLLIN }; /* Ignored if -1 */
+        owner[n] = NULL;
+        pfd[n++] = (struct pollfd){ .fd = inotify_fd, .events = POLLIN };
+        nattr = n;
+        for (i = 0; i < nups; i++)
+            for (j = 0; j < ATTR_COUNT; j++) {
+                if (ups[i].fd[j] < 0) continue;
+                owner[n] = NULL;
+                pfd[n++] = (struct pollfd){ .fd = ups[i].fd[j], .events = POLLPRI };
+            }
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            if (clients[i].fd < 0) continue;
+            owner[n] = &clients[i];
+            pfd[n++] = (struct pollfd){ .fd = clients[i].fd, .events = POLLIN };
+        }
+
+        if (poll(pfd, n, -1) < 0) {
+            if (errno == EINTR) continue;
+            logmsg("poll: %s\n", strerror(errno));
+            return 1;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (!pfd[i].revents) continue;
+            if (i < nlisteners) client_accept(pfd[i].fd);
+            else if (i == uevent_idx) uevent_read();
+            else if (i < nattr) ups_changed();
+            else if (!owner[i]) ups_changed(); /* sysfs_notify() on an attribute */
+            else if (owner[i]->fd >= 0) client_read(owner[i]);
+        }
+    }
+}